@@ -3,7 +3,7 @@
 #
 # End users can compile with the simpler:
 #
-# gcc -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0
+# gcc -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0 -lpthread -lX11
 # 
 
-gcc -g -std=c89 -fno-builtin -pedantic -Wall -Wextra -Werror -Wconversion -Wshadow -Wstrict-prototypes -Wold-style-definition -Wmissing-prototypes -Wmissing-declarations -Wdeclaration-after-statement -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0
\ No newline at end of file
+gcc -g -std=c89 -fno-builtin -pedantic -Wall -Wextra -Werror -Wconversion -Wshadow -Wstrict-prototypes -Wold-style-definition -Wmissing-prototypes -Wmissing-declarations -Wdeclaration-after-statement -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0 -lpthread -lX11
\ No newline at end of file
@@ -1,7 +1,11 @@
 /*
   compile with:
   
-  gcc -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0
+  gcc -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0 -lpthread -lX11
+  
+  or, with NATIVE_X11_FOCUS set to 0 below:
+  
+  gcc -o tourBoxEliteDriver tourBoxEliteDriver.c -lusb-1.0 -lpthread
   
 */
 
@@ -29,6 +33,24 @@
    Increasing this number increases the RAM used by the driver. */
 #define MAX_KEY_SEQUENCE_SLEEPS  10
 
+/* How many different key sequences can the settings file have, across all
+     applications?
+   Each mapped control or 2-button combo needs one, but identical ones
+     (the same keys, sleeps, and HOLD) share, even between applications.
+   If your settings file has more than this, the extra ones are skipped
+     with a warning message.
+   Increasing this number increases the RAM used by the driver. */
+#define MAX_COMPILED_ACTIONS  4096
+
+/* How many uinput events can the compiled key sequences hold, all together?
+   Each key combo takes one event for each key pressed, one for each key
+     released, and two more, but identical sequences share their events,
+     even between applications.
+   If your settings file needs more, the extra sequences are skipped with
+     a warning message.
+   Increasing this number increases the RAM used by the driver. */
+#define MAX_PROGRAM_EVENTS  32768
+
 /* How long can a quoted application name in the settings file be?
    Quoted names longer than this are truncated internally.
    Note that these "names" are meant to be unique patterns to match, and
@@ -36,6 +58,91 @@
    Increasing this number increases the RAM used by the driver slightly. */
 #define MAX_APPLICATION_NAME_LENGTH  80
 
+/* How many entries can the table that matches application names against
+     window titles hold?
+   The quoted application names need (1 + their total length) times
+     (1 + how many different characters they use) entries, which is about
+     60,000 for 64 typical names.
+   If your settings file needs more, the driver warns you, and falls back
+     to slower matching that checks one name at a time.
+   Increasing this number increases the RAM used by the driver. */
+#define MATCHER_TABLE_SIZE  131072
+
+/* How many USB reads are kept queued with the TourBox at once?
+   While the driver is busy handling one read, the other queued reads keep
+     accepting input from the TourBox, so fast knob spins don't pile up in
+     the device.
+   Must be at least 1.
+   Increasing this number increases the RAM used by the driver slightly. */
+#define NUM_ASYNC_USB_TRANSFERS  4
+
+/* How long does an application have to stay in front before its haptics
+     are sent to the TourBox, in milliseconds?
+   Its key mappings are used right away, but haptics take a USB transfer,
+     so when you alt-tab past several windows, only the one you stop on
+     gets its haptics sent, and nothing is sent if you end up back where
+     you started.
+   Set to 0 to send haptics on every application switch. */
+#define HAPTIC_SETTLE_MS  150
+
+/* How many TourBox devices can one driver drive at once?
+   With no DEVICE lines in the settings file, every TourBox that is plugged
+     in is opened, up to this many.
+   Increasing this number increases the RAM used by the driver slightly. */
+#define MAX_NUM_TOURBOXES  4
+
+/* How many TourBox input events can wait in the queue between the main
+     event loop, which reads USB, and the thread that sends key sequences?
+   The queue only fills up if key sequences (especially ones with SLEEP_
+     triggers) take longer to send than the user takes to generate input.
+   Must be a power of 2.
+   Increasing this number increases the RAM used by the driver slightly. */
+#define INPUT_QUEUE_SIZE  256
+
+/* How many input events from one TourBox can be set aside while it waits
+     out a SLEEP_ trigger, or a PACE setting, so that input from other
+     TourBoxes in the queue behind them can still be handled?
+   Once one TourBox has this many set aside, the queue isn't emptied any
+     further until it has room again, and the overflow policies below
+     kick in as the queue fills up.
+   Increasing this number increases the RAM used by the driver slightly. */
+#define MAX_WAITING_INPUTS  64
+
+/* How many uinput events can be gathered up and written to /dev/uinput
+     with one system call?
+   Events are also written at the end of each key sequence, and before
+     each SLEEP_ trigger, so that they aren't held up by the sleep.
+   64 is the smallest buffer the kernel gives each program reading the
+     keyboard, so larger batches risk overflowing a slow reader.
+   Must be at least 1, and 1 writes each event separately.
+   Increasing this number increases the RAM used by the driver slightly. */
+#define UINPUT_BATCH_SIZE  64
+
+/* What happens to the turns of each widget when the input queue is full?
+     INPUT_QUEUE_BLOCK        stop handling USB reads until there is room
+     INPUT_QUEUE_DROP_OLDEST  drop the oldest queued entry to make room, if
+                                it is a turn of the same widget on the
+                                same TourBox
+     INPUT_QUEUE_COALESCE     merge repeats of the same turn into one entry
+   Button presses and releases are never dropped or merged, and always
+     block when the queue is full.
+   When a turn can't be handled with its policy (for example, the oldest
+     queued entry is a button press, a turn of another widget, or input
+     from another TourBox, or the repeat is of a different turn), it falls
+     back to blocking. */
+#define KNOB_TURN_QUEUE_POLICY    INPUT_QUEUE_COALESCE
+#define SCROLL_TURN_QUEUE_POLICY  INPUT_QUEUE_COALESCE
+#define DIAL_TURN_QUEUE_POLICY    INPUT_QUEUE_DROP_OLDEST
+
+/* Track the window in the foreground through our own connection to the
+     X server, which tells us about window switches as they happen?
+   Set to 0 to build without Xlib (and without -lX11), in which case the
+     driver runs xprop every FOCUS_POLL_MS to see which window is in the
+     foreground.
+   Even when this is 1, the driver falls back to running xprop if it can't
+     connect to the X server. */
+#define NATIVE_X11_FOCUS  1
+
 
 
 
@@ -43,7 +150,9 @@
 
 /* for popen and pclose */
 /* and for nanosleep */
-#define _POSIX_C_SOURCE 199309L
+/* and for pthreads */
+/* and for readlink */
+#define _POSIX_C_SOURCE 200112L
 
 
 #define inline __inline__
@@ -67,6 +176,19 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#if NATIVE_X11_FOCUS
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#endif
+#include <termios.h>
+#include <dirent.h>
+#include <regex.h>
 
 
 /* the VID and PID of a TourBox Elite */
@@ -80,6 +202,30 @@
 #define EP_IN  0x82 
 #define USB_TIMEOUT 500
 
+/* how often we check which window is in the foreground, when we can't
+   get window switches from the X server */
+#define FOCUS_POLL_MS 500
+
+/* how long we wait between tries to reopen a TourBox that went away */
+#define RECONNECT_RETRY_MS 250
+
+/* limits for DEVICE lines in the settings file */
+#define MAX_TOURBOX_NAME_LENGTH  31
+#define MAX_USB_PORT_PATH_LENGTH  31
+#define MAX_USB_SERIAL_LENGTH  63
+
+/* USB allows hubs 7 deep */
+#define MAX_USB_PORT_DEPTH  7
+
+/* haptics and rotation speed for every turn widget and combo */
+#define TOURBOX_SETUP_MESSAGE_LENGTH  94
+
+/* like /dev/ttyACM0 */
+#define MAX_TTY_PATH_LENGTH  31
+
+/* for FOCUS fifo lines in the settings file */
+#define MAX_FOCUS_FIFO_PATH_LENGTH  255
+
 
 #define NUM_TOURBOX_CONTROLS 20
 #define NUM_TOURBOX_PRESS_CONTROLS 14
@@ -464,8 +610,64 @@ void populateSetupMap( void ) {
 
 
 
+/* The key sequence mapped to one control (or 2-button combo), compiled
+   from the sequence arrays of an ApplicationMapping once the settings
+   file is loaded into a program of ops, with all of its uinput events
+   rendered ahead of time, so that sending it is mostly copying events. */
+typedef struct CompiledAction {
+        /* its ops, in programOps */
+        int firstOp;
+        int numOps;
+
+        /* its events, in programEvents
+           For REPEAT_KEYS, these are exactly the events of one send. */
+        int firstEvent;
+        int numEvents;
+
+        /* how repeats of this action (from a fast turn) can be sent, one
+           of the REPEAT_ values below */
+        unsigned char repeatKind;
+
+        /* for REPEAT_SCROLL, how far one send scrolls, up is positive */
+        int scrollPerSend;
+    } CompiledAction;
+
+
+/* has SLEEP_ triggers or HOLD, so each repeat has to be sent separately */
+#define REPEAT_ONE_AT_A_TIME  0
+/* only keys, so repeats can be sent in one batch */
+#define REPEAT_KEYS           1
+/* only MOUSE_SCROLL_ steps, so repeats can be one bigger scroll */
+#define REPEAT_SCROLL         2
+
+
+
 typedef struct ApplicationMapping {
         char name[ MAX_APPLICATION_NAME_LENGTH + 1 ];
+
+        /* which property of the window name is matched against, one of
+           the MATCH_ values below */
+        int matchField;
+
+        /* how name is matched, one of the PATTERN_ values below */
+        int patternKind;
+
+        /* how many literal characters name has
+           When more than one re: or glob: mapping matches, the one with
+           the most wins. */
+        int specificity;
+
+        /* index into tourBoxDevices of the only TourBox this mapping
+           applies to (from a PROFILE line), or ALL_TOURBOXES */
+        int tourBoxIndex;
+
+        /* built from the sequence arrays below by compileAllActions
+           first index is one more than the index of the press control held
+             down as a modifier, so 0 is nothing held
+           second index is the main control being manipulated
+           NULL where nothing is mapped */
+        const CompiledAction *actions[ NUM_TOURBOX_PRESS_CONTROLS + 1 ]
+                                     [ NUM_TOURBOX_CONTROLS ];
         
         /*
           first index is the main control being manipulated
@@ -503,9 +705,21 @@ typedef struct ApplicationMapping {
         /* 0 for no-HOLD, 1 for HOLD
            HOLD means we hold down the final key combination until our
            tourbox control is released */
-        char holdLastKeyCombo[ NUM_TOURBOX_TURN_WIDGETS ]
+        char holdLastKeyCombo[ NUM_TOURBOX_CONTROLS ]
                              [ NUM_TOURBOX_PRESS_CONTROLS + 1 ];
 
+        /* built from hapticStrength and rotationSpeed once the settings
+           file is loaded */
+        unsigned char setupMessage[ TOURBOX_SETUP_MESSAGE_LENGTH ];
+
+        /* from a PACE line, 0 for no pacing
+           the shortest time between key combos, in milliseconds */
+        int paceComboGapMS;
+
+        /* the most turns per second that send key sequences, and how many
+           can go at once before that limit kicks in */
+        int paceTurnRate;
+        int paceTurnBurst;
         
     } ApplicationMapping;
 
@@ -517,6 +731,289 @@ ApplicationMapping appMappings[MAX_NUM_APPS];
 int numAppMappings = 0;
 
 
+/* for ApplicationMapping.tourBoxIndex */
+#define ALL_TOURBOXES     -1
+/* for mappings after a PROFILE line naming a TourBox that doesn't exist */
+#define UNKNOWN_TOURBOX   -2
+
+
+/* for ApplicationMapping.matchField, picked by the keyword before the
+   quoted application name in the settings file */
+#define MATCH_TITLE    0
+#define MATCH_CLASS    1
+#define MATCH_PROCESS  2
+#define MATCH_EXE      3
+
+#define NUM_MATCH_FIELDS  4
+
+/* indexed by MATCH_ value */
+const char *matchFieldKeywords[ NUM_MATCH_FIELDS ] =
+    { "TITLE", "CLASS", "PROCESS", "EXE" };
+
+/* bits for the fields of each kind, as 1 << MATCH_ value
+   The stable ones don't change for as long as a window is open. */
+#define MATCH_TITLE_FIELDS   ( 1 << MATCH_TITLE )
+#define MATCH_STABLE_FIELDS  ( ( 1 << MATCH_CLASS ) | ( 1 << MATCH_PROCESS ) | \
+                               ( 1 << MATCH_EXE ) )
+
+/* how many mappings match on the window title */
+int numTitleMappings = 0;
+
+
+/* for ApplicationMapping.patternKind, picked by a re: or glob: prefix on
+   the quoted application name in the settings file */
+#define PATTERN_SUBSTRING  0
+#define PATTERN_REGEX      1
+#define PATTERN_GLOB       2
+/* for a re: or glob: pattern that didn't compile, which never matches */
+#define PATTERN_INVALID    3
+
+/* indexed by PATTERN_ value */
+const char *patternKindPrefixes[] = { "", "re:", "glob:", "" };
+
+/* compiled when the settings file is loaded, for the mappings with a
+   PATTERN_REGEX or PATTERN_GLOB name, indexed like appMappings */
+regex_t mappingPatterns[MAX_NUM_APPS];
+
+
+typedef struct TourBoxDevice {
+        /* position in tourBoxDevices, and in input queue entries */
+        unsigned char index;
+        
+        /* from the DEVICE line in the settings file, or empty
+           An empty selectPort or selectSerial matches any TourBox. */
+        char name[ MAX_TOURBOX_NAME_LENGTH + 1 ];
+        char selectPort[ MAX_USB_PORT_PATH_LENGTH + 1 ];
+        char selectSerial[ MAX_USB_SERIAL_LENGTH + 1 ];
+
+        /* USB port path (like 3-1.2) it was last opened on, or empty */
+        char portPath[ MAX_USB_PORT_PATH_LENGTH + 1 ];
+        
+        /* 1 while open, through whichever transport */
+        char connected;
+        
+        /* for the libusb transport, NULL while not open */
+        libusb_device_handle *usbHandle;
+
+        /* for the ttyACM transport, -1 while not open */
+        int ttyFD;
+        char ttyPath[ MAX_TTY_PATH_LENGTH + 1 ];
+
+        /* set when the open TourBox should be closed and reopened */
+        char lost;
+
+        /* 1 once it has been opened, so opening it again is a reconnect */
+        char wasOpened;
+        
+        
+        /* mapping for the application in the foreground, or NULL if none
+           matches
+           Published by the focus thread, read by the executor thread. */
+        ApplicationMapping *volatile activeMapping;
+
+        /* the mapping we last sent a setup message for, only touched by
+           the main event loop */
+        ApplicationMapping *setupMapping;
+
+        /* 1 while waiting HAPTIC_SETTLE_MS to send the setup message for
+           settleMapping, only touched by the main event loop */
+        char setupSettling;
+        ApplicationMapping *settleMapping;
+
+        /* the highest ranked mapping that matches a stable field of the active
+           window, or NULL, only touched by the focus thread */
+        ApplicationMapping *stableMapping;
+        
+        
+        /* async reads, only touched by the main event loop */
+        struct libusb_transfer *inputTransfers[ NUM_ASYNC_USB_TRANSFERS ];
+
+        unsigned char inputBuffers[ NUM_ASYNC_USB_TRANSFERS ][ 512 ];
+
+        /* when each transfer was last submitted */
+        double inputQueuedMS[ NUM_ASYNC_USB_TRANSFERS ];
+
+        /* 1 for each transfer that libusb currently holds */
+        char inputInFlight[ NUM_ASYNC_USB_TRANSFERS ];
+
+        /* 1 while stopAsyncInput is cancelling the transfers, so that
+           reads completing meanwhile aren't queued back up */
+        char inputStopping;
+
+
+        /* async setup message sends, only touched by the main event loop */
+        struct libusb_transfer *setupTransfer;
+        
+        unsigned char setupBuffer[ TOURBOX_SETUP_MESSAGE_LENGTH ];
+
+        char setupInFlight;
+
+        /* the last setup message we sent or started sending, if
+           setupKnown is 1 */
+        unsigned char sentSetupMessage[ TOURBOX_SETUP_MESSAGE_LENGTH ];
+
+        char setupKnown;
+
+        /* the setup message to send once setupTransfer is done, if
+           setupPending is 1 */
+        unsigned char pendingSetupMessage[ TOURBOX_SETUP_MESSAGE_LENGTH ];
+
+        char setupPending;
+
+        /* when the setup message in setupBuffer started sending */
+        double setupStartMS;
+
+
+        /* input decoding state, only touched by the executor thread */
+
+        /* index into tourBoxPressControlCodes for what button is held
+           If multiple buttons are held, the oldest one wins. */
+        int heldPressControlIndex;
+
+        /* events that release a combo left held down by HOLD, to send
+           when the held TourBox control is released, or NULL if nothing
+           is held */
+        const struct input_event *heldReleases;
+
+        int numHeldReleases;
+
+        /* a key sequence waiting out a SLEEP_ trigger, or NULL if none
+           Later input from this TourBox waits until it is done. */
+        const CompiledAction *runningAction;
+
+        /* index of the op in runningAction to pick up at */
+        int runningOp;
+
+        /* when runningAction's sleep ends, in getCurrentTimeMS time
+           Each sleep ends a fixed time after the previous one ended, no
+           matter how late we woke up, so chains of sleeps don't drift. */
+        double runningResumeMS;
+
+        /* paceComboGapMS of the mapping runningAction came from */
+        int runningComboGapMS;
+
+        /* when the last key combo was sent, for paceComboGapMS */
+        double lastComboMS;
+
+        /* token bucket for paceTurnRate, with how many turns can go now
+           as of turnTokensMS */
+        double turnTokens;
+        double turnTokensMS;
+
+        /* 1 if a turn is waiting for a token, until turnWaitMS */
+        char turnWaiting;
+        double turnWaitMS;
+
+        
+        /* for measuring reconnect latency, or -1 when not measuring */
+        double arrivedMS;
+        double reconnectedMS;
+
+        unsigned long numReconnects;
+        
+    } TourBoxDevice;
+
+
+/* only the first numTourBoxDevices are in use
+   Each is added by a DEVICE line in the settings file, or, if there are
+   none, when a TourBox is first opened.  They are never removed, so an
+   index into here stays valid. */
+TourBoxDevice tourBoxDevices[ MAX_NUM_TOURBOXES ];
+
+int numTourBoxDevices = 0;
+
+/* 1 if the settings file has DEVICE lines, so we only open the TourBoxes
+   they select */
+char namedTourBoxes = 0;
+
+
+/* A transport moves bytes between the driver and each TourBox.
+   The libusb transport talks to the TourBox's vendor interface directly.
+   The ttyACM transport uses the /dev/ttyACM device that the kernel's
+   cdc_acm driver makes for the TourBox, with plain read and write. */
+typedef struct TourBoxTransport {
+        /* as given on a TRANSPORT line in the settings file */
+        const char *name;
+        
+        /* sets up the transport, once the main event loop is ready
+           returns 1 on success, 0 on failure */
+        char (*init)( void );
+
+        /* undoes init, once every TourBox is disconnected */
+        void (*close)( void );
+
+        /* opens every TourBox we want that isn't open yet, into the slot
+           from findTourBoxSlot, and calls connectTourBox for it
+           returns how many were connected */
+        int (*scan)( void );
+
+        /* for the handshake, before input starts
+           returns 1 if all of inData was written */
+        char (*writeSync)( TourBoxDevice *inDevice,
+                           unsigned char *inData, int inLength );
+
+        /* for the handshake, before input starts
+           waits up to USB_TIMEOUT for inLength bytes
+           returns how many bytes were read */
+        int (*readSync)( TourBoxDevice *inDevice,
+                         unsigned char *outData, int inLength );
+
+        /* starts passing input to decodeTourBoxInput from the main
+           event loop
+           returns 1 on success, 0 on failure */
+        char (*startInput)( TourBoxDevice *inDevice );
+
+        /* starts sending inDevice->setupBuffer, and calls
+           noteSetupMessageDone when it is done, which might be before
+           this returns
+           returns 1 if the send started, 0 on failure */
+        char (*sendSetup)( TourBoxDevice *inDevice );
+
+        /* stops input and closes an open TourBox */
+        void (*closeDevice)( TourBoxDevice *inDevice );
+        
+    } TourBoxTransport;
+
+
+/* picked with a TRANSPORT line in the settings file */
+TourBoxTransport *transport = NULL;
+
+
+/* sets up an unused slot in tourBoxDevices */
+void initTourBoxDevice( TourBoxDevice *inDevice, int inIndex );
+
+/* returns the name of a TourBox for messages */
+const char *getTourBoxLabel( TourBoxDevice *inDevice );
+
+/* call when a TourBox stops responding, to close it and start trying
+   to reopen it
+   Safe to call from inside libusb callbacks. */
+void noteTourBoxLost( TourBoxDevice *inDevice );
+
+
+
+void initTourBoxDevice( TourBoxDevice *inDevice, int inIndex ) {
+    memset( inDevice, 0, sizeof( TourBoxDevice ) );
+
+    inDevice->index = (unsigned char)inIndex;
+    inDevice->usbHandle = NULL;
+    inDevice->ttyFD = -1;
+    inDevice->activeMapping = NULL;
+    inDevice->heldPressControlIndex = -1;
+    inDevice->arrivedMS = -1;
+    inDevice->reconnectedMS = -1;
+    }
+
+
+
+const char *getTourBoxLabel( TourBoxDevice *inDevice ) {
+    if( inDevice->name[0] != '\0' ) {
+        return inDevice->name;
+        }
+    return inDevice->portPath;
+    }
+
+
 
 /* takes any control in tourBoxControlCodes
    returns an index into tourBoxTurnWidgets, or -1 if control code
@@ -2122,533 +2619,6222 @@ int getControlCodeIndex( int inTourBoxPressControlCodeIndex ) {
 
 
 
-/* Gets the name of the active window, filling inBuffer.
-   If name too long for buffer, it is cut off.
+/* internal limits for what we read about a window, longer values are
+   cut off */
+#define MAX_WM_CLASS_LENGTH      255
+#define MAX_PROCESS_NAME_LENGTH  15
+#define MAX_EXE_PATH_LENGTH      255
+
+
+/* everything we can match an application mapping against */
+typedef struct WindowInfo {
+        /* X window id, or 0 if unknown */
+        unsigned long id;
+
+        /* some windows have long names, like firefox windo name for a
+           long google search string */
+        char title[ 1024 ];
+
+        /* instance and class names from WM_CLASS, separated by a space */
+        char wmClass[ MAX_WM_CLASS_LENGTH + 1 ];
+
+        /* from /proc/<pid>/comm and /proc/<pid>/exe for _NET_WM_PID, or
+           empty if the window doesn't say which process it belongs to */
+        char processName[ MAX_PROCESS_NAME_LENGTH + 1 ];
+        char exePath[ MAX_EXE_PATH_LENGTH + 1 ];
+
+        /* from _NET_WM_PID, or 0 if the window doesn't say */
+        unsigned long pid;
+    } WindowInfo;
+
+
+/* Gets the id and title of the active window, filling ioWindow, using
+   xprop.
+   The stable fields (WM_CLASS and the process) are only looked up again
+   when the window id changes, in which case outNewWindow is set to 1.
+   Values too long for ioWindow are cut off.
    returns 1 on success, 0 on failure. */
-char getActiveWindowName( char *inBuffer, int inBufferSize );
+char getActiveWindowInfo( WindowInfo *ioWindow, char *outNewWindow );
+
+/* copies the value from an xprop output line (like WM_NAME(STRING) = "x")
+   into outValue, leaving out quotes, and commas too if inSkipCommas is 1 */
+void copyXpropValue( const char *inLine, char *outValue, int inValueLength,
+                     char inSkipCommas );
 
+/* fills the process fields of ioWindow from /proc for inPID, or empties
+   them if inPID is 0 */
+void readWindowProcess( unsigned long inPID, WindowInfo *ioWindow );
 
-char getActiveWindowName( char *inBuffer, int inBufferSize ) {
-    char retVal = 0;
+/* fills the stable fields of ioWindow from what we remember about the
+   window with its id, if it still belongs to process inPID
+   returns 1 if it did, or 0 if they need looking up */
+char restoreWindowInfo( WindowInfo *ioWindow, unsigned long inPID );
+
+
+char getActiveWindowInfo( WindowInfo *ioWindow, char *outNewWindow ) {
+    char line[ sizeof( ioWindow->title ) + 64 ];
+    char command[ 128 ];
+    const char *idStart;
+    unsigned long id = 0;
+    unsigned long pid = 0;
+    char gotTitle = 0;
+    FILE *commandOutput;
+
+    *outNewWindow = 0;
     
-    FILE *commandOutput = popen(
-        "xprop -id $(xprop -root -f _NET_ACTIVE_WINDOW "
-        "0x \" \\$0\\n\" _NET_ACTIVE_WINDOW | "
-        "awk '{print $2}') WM_NAME | "
-        "awk -F'=' '{print $2}' | sed 's/\"//g'", "r" );
+    commandOutput = popen( "xprop -root _NET_ACTIVE_WINDOW", "r" );
     
-    if( commandOutput != NULL ) {
+    if( commandOutput == NULL ) {
+        return 0;
+        }
+    /* like _NET_ACTIVE_WINDOW(WINDOW): window id # 0x3a00007 */
+    if( fgets( line, sizeof( line ), commandOutput ) != NULL ) {
+        idStart = strstr( line, "# " );
+        
+        if( idStart != NULL &&
+            sscanf( idStart + 2, "%lx", &id ) != 1 ) {
+            id = 0;
+            }
+        }
+    pclose( commandOutput );
 
-        if( fgets( inBuffer, inBufferSize, commandOutput ) != NULL ) {
-            retVal = 1;
+    if( id == 0 ) {
+        return 0;
+        }
+
+    if( id != ioWindow->id ) {
+        *outNewWindow = 1;
+        ioWindow->id = id;
+        ioWindow->wmClass[0] = '\0';
+        readWindowProcess( 0, ioWindow );
+        }
+
+    sprintf( command, "xprop -id 0x%lx WM_NAME%s", id,
+             *outNewWindow ? " WM_CLASS _NET_WM_PID" : "" );
+    
+    commandOutput = popen( command, "r" );
+    
+    if( commandOutput == NULL ) {
+        return 0;
+        }
+    
+    while( fgets( line, sizeof( line ), commandOutput ) != NULL ) {
+        if( startsWith( line, "WM_NAME(" ) ) {
+            copyXpropValue( line, ioWindow->title,
+                            sizeof( ioWindow->title ), 0 );
+            gotTitle = 1;
+            }
+        else if( startsWith( line, "WM_CLASS(" ) ) {
+            copyXpropValue( line, ioWindow->wmClass,
+                            sizeof( ioWindow->wmClass ), 1 );
+            }
+        else if( startsWith( line, "_NET_WM_PID(" ) &&
+                 strstr( line, "= " ) != NULL &&
+                 sscanf( strstr( line, "= " ) + 2, "%lu", &pid ) != 1 ) {
+            pid = 0;
             }
-        pclose( commandOutput );
+        }
+    pclose( commandOutput );
+
+    if( *outNewWindow && ! restoreWindowInfo( ioWindow, pid ) ) {
+        readWindowProcess( pid, ioWindow );
         }
     
-    return retVal;
+    return gotTitle;
     }
 
 
-/* returns pointer to mapping, or NULL if there's no match. */
-ApplicationMapping *getMatchingMapping( const char *inWindowName );
+
+void copyXpropValue( const char *inLine, char *outValue, int inValueLength,
+                     char inSkipCommas ) {
+    const char *value = strstr( inLine, "= " );
+    int numCopied = 0;
+
+    outValue[0] = '\0';
+    
+    if( value == NULL ) {
+        return;
+        }
+    value += 2;
+
+    while( *value != '\0' && *value != '\n' &&
+           numCopied < inValueLength - 1 ) {
+        
+        if( *value != '"' && ! ( inSkipCommas && *value == ',' ) ) {
+            outValue[ numCopied ] = *value;
+            numCopied++;
+            }
+        value++;
+        }
+    outValue[ numCopied ] = '\0';
+    }
 
 
-ApplicationMapping *getMatchingMapping( const char *inWindowName ) {
+
+void readWindowProcess( unsigned long inPID, WindowInfo *ioWindow ) {
+    char path[ 64 ];
+    FILE *commFile;
+    ssize_t exeLength;
     int i;
-    for( i=0; i<numAppMappings; i++ ) {
-        ApplicationMapping *m = &( appMappings[i] );
 
-        if( contains( inWindowName, m->name ) ) {
-            return m;
+    ioWindow->processName[0] = '\0';
+    ioWindow->exePath[0] = '\0';
+    ioWindow->pid = inPID;
+
+    if( inPID == 0 ) {
+        return;
+        }
+
+    sprintf( path, "/proc/%lu/comm", inPID );
+    commFile = fopen( path, "r" );
+
+    if( commFile != NULL ) {
+        if( fgets( ioWindow->processName, sizeof( ioWindow->processName ),
+                   commFile ) == NULL ) {
+            ioWindow->processName[0] = '\0';
+            }
+        fclose( commFile );
+
+        for( i=0; ioWindow->processName[i] != '\0'; i++ ) {
+            if( ioWindow->processName[i] == '\n' ) {
+                ioWindow->processName[i] = '\0';
+                break;
+                }
             }
         }
-    return NULL;
+
+    sprintf( path, "/proc/%lu/exe", inPID );
+    exeLength = readlink( path, ioWindow->exePath,
+                          sizeof( ioWindow->exePath ) - 1 );
+
+    if( exeLength < 0 ) {
+        exeLength = 0;
+        }
+    ioWindow->exePath[ exeLength ] = '\0';
     }
 
 
 
-/* makes inMappig active and sends setup message for it.
-   returns 1 on success, 0 on failure.*/
-char makeMappingActive( ApplicationMapping *inMapping,
-                        libusb_device_handle *inUSB );
+/* Application name matcher.
+   All quoted application names are compiled into one Aho-Corasick
+   automaton when the settings file is loaded, so each window field is
+   scanned once, no matter how many applications there are.
 
+   Bytes that appear in application names are mapped to a small set of
+   classes (class 0 is every other byte), and the transitions are a flat
+   table with a row of classes for each state.  Every state has a
+   transition for every class, so a scan just does one table lookup per
+   byte.
 
-/* sends default setup message, with haptics turned off for all controls
-   returns 1 on success, 0 on failure.*/
-char sendDefaultSetupMessage( libusb_device_handle *inUSB );
+   A scan marks every mapping whose name occurs in the field in a bit
+   set, by rank, and getMatchingMapping picks the first marked one.
 
+   re: and glob: patterns can't go in the automaton.  They are compiled
+   with regcomp when the settings file is loaded, and only run by
+   findWindowMatches, which only happens when a window isn't in the match
+   cache.
 
+   Ranks are worked out once, when the settings file is loaded.  Mappings
+   for a PROFILE always come before mappings for all TourBoxes.  After
+   that, the mapping whose name has the most literal characters wins, so
+   "Blender - Sculpt" beats "Blender" no matter which comes first in the
+   file, and glob:"*" loses to everything.  Mappings that are just as
+   specific keep their file order. */
 
-unsigned char tourBoxSetupMessage[] = {
-    0xb5, 0x00, 0x5d, 0x04, 0x00, 0x05, 0x00, 0x06,
-    0x00, 0x07, 0x00, 0x08, 0x00, 0x09, 0x00, 0x0b,
-    0x00, 0x0c, 0x00, 0x0d, 0x00, 0x0e, 0x00, 0x0f,
-    0x00, 0x26, 0x00, 0x27, 0x00, 0x28, 0x00, 0x29,
-    0x00, 0x3b, 0x00, 0x3c, 0x00, 0x3d, 0x00, 0x3e,
-    0x00, 0x3f, 0x00, 0x40, 0x00, 0x41, 0x00, 0x42,
-    0x00, 0x43, 0x00, 0x44, 0x00, 0x45, 0x00, 0x46,
-    0x00, 0x47, 0x00, 0x48, 0x00, 0x49, 0x00, 0x4a,
-    0x00, 0x4b, 0x00, 0x4c, 0x00, 0x4d, 0x00, 0x4e,
-    0x00, 0x4f, 0x00, 0x50, 0x00, 0x51, 0x00, 0x52,
-    0x00, 0x53, 0x00, 0x54, 0x00, 0xa8, 0x00, 0xa9,
-    0x00, 0xaa, 0x00, 0xab, 0x00, 0xfe };
+/* each character of each name can add a state, plus the root */
+#define MAX_MATCHER_STATES  ( MAX_NUM_APPS * MAX_APPLICATION_NAME_LENGTH + 1 )
 
+#define MATCH_BITS_WORDS  ( ( MAX_NUM_APPS + 31 ) / 32 )
 
-char sendDefaultSetupMessage( libusb_device_handle *inUSB ) {
-    int t;
-    int p;
 
-    int numSent;
-    int usbResult;
-    char success = 0;
-    
-    int setupIndex;
-    for( t=0; t < NUM_TOURBOX_TURN_WIDGETS; t++ ) {
-        /* 1 extra mapping (p <=) for turn widget with no modifier */
-        for( p=0; p <= NUM_TOURBOX_PRESS_CONTROLS; p++ ) {
+/* state * matcherNumClasses + class */
+unsigned int matcherTransitions[ MATCHER_TABLE_SIZE ];
 
-            setupIndex = tourBoxSetupMap[t][p];
-            tourBoxSetupMessage[ setupIndex ] = 0;
-            }
-        }
-    usbResult =
-        libusb_bulk_transfer( inUSB,
-                              EP_OUT,
-                              tourBoxSetupMessage,
-                              sizeof(tourBoxSetupMessage),
-                              &numSent,
-                              USB_TIMEOUT );
-    if( usbResult == 0 &&
-        numSent == sizeof( tourBoxSetupMessage ) ) {
-        success = 1;
-        }
-    return success;
-    }
+unsigned char matcherByteClasses[ 256 ];
 
+int matcherNumClasses = 0;
 
+unsigned int matcherNumStates = 0;
 
-char makeMappingActive( ApplicationMapping *inMapping,
-                        libusb_device_handle *inUSB ) {
-    int i;
-    int t;
-    int p;
-    int h;
-    int r;
-    unsigned char hByte;
-    unsigned char rByte;
-    int numSent;
-    int usbResult;
-    char success = 0;
-    
-    int setupIndex;
-    
-    for( i=0; i<numAppMappings; i++ ) {
-        ApplicationMapping *m = &( appMappings[i] );
-        if( m == inMapping ) {
-            /* send 94-byte setup message */
+/* longest proper suffix of each state that is also a state */
+unsigned int matcherFail[ MAX_MATCHER_STATES ];
 
-            for( t=0; t < NUM_TOURBOX_TURN_WIDGETS; t++ ) {
-                /* 1 extra mapping (p <=) for turn widget with no modifier */
-                for( p=0; p <= NUM_TOURBOX_PRESS_CONTROLS; p++ ) {
+/* for the breadth first walk in buildMatcher */
+unsigned int matcherQueue[ MAX_MATCHER_STATES ];
 
-                    setupIndex = tourBoxSetupMap[t][p];
+/* first mapping whose name ends at each state, or -1 */
+int matcherFirstMapping[ MAX_MATCHER_STATES ];
 
-                    h = m->hapticStrength[t][p];
-                    r = m->rotationSpeed[t][p];
-                    switch( h ) {
-                        case 0:
-                            hByte = 0;
-                            break;
-                        case 1:
-                            hByte = 4;
-                            break;
-                        case 2:
-                            hByte = 8;
-                            break;
-                        }
-                    switch( r ) {
-                        case 0:
-                            rByte = 2;
-                            break;
-                        case 1:
-                            rByte = 1;
-                            break;
-                        case 2:
-                            rByte = 0;
-                            break;
-                        }
-                    tourBoxSetupMessage[ setupIndex ] = hByte | rByte;
-                    }
-                }
-        
-            usbResult =
-                libusb_bulk_transfer( inUSB,
-                                      EP_OUT,
-                                      tourBoxSetupMessage,
-                                      sizeof(tourBoxSetupMessage),
-                                      &numSent,
-                                      USB_TIMEOUT );
-            if( usbResult == 0 &&
-                numSent == sizeof( tourBoxSetupMessage ) ) {
-                success = 1;
-                }
-            }
-        }
+/* next mapping with the same name, or -1 */
+int matcherNextMapping[ MAX_NUM_APPS ];
 
-    return success;
-    }
+/* next state down the fail links that has a mapping, or 0 for none
+   The root is never in here, because its mappings (empty names) match
+   everything and get marked at the start of each scan. */
+unsigned int matcherOutputLink[ MAX_MATCHER_STATES ];
 
+/* 0 if the names didn't fit in MATCHER_TABLE_SIZE, in which case each
+   name is checked with contains instead */
+char matcherBuilt = 0;
 
-/* emit a uinput event */
-void uinputEmit( int inUinputFile, unsigned short inType,
-                 unsigned short inCode, int inVal );
 
+/* which mappings match the active window, by rank, for the title and
+   for the stable fields
+   Only touched by the focus thread. */
+unsigned int titleMatchBits[ MATCH_BITS_WORDS ];
+unsigned int stableMatchBits[ MATCH_BITS_WORDS ];
 
 
-void uinputEmit( int inUinputFile, unsigned short inType,
-                 unsigned short inCode, int inVal ) {
-    struct input_event event;
+/* indices into appMappings, in the order they're tried: file order,
+   except that the re: and glob: patterns are sorted among themselves,
+   most specific first */
+int mappingsByRank[ MAX_NUM_APPS ];
 
-    event.type = inType;
-    event.code = inCode;
-    event.value = inVal;
-    /* timestamp values below are ignored */
-    event.time.tv_sec = 0;
-    event.time.tv_usec = 0;
+/* the rank of each mapping, indexed like appMappings */
+int mappingRanks[ MAX_NUM_APPS ];
 
-    write( inUinputFile, &event, sizeof(event) );
-    }
+/* indices into appMappings of the mappings with a PATTERN_REGEX or
+   PATTERN_GLOB name, in file order */
+int patternMappings[ MAX_NUM_APPS ];
 
+int numPatternMappings = 0;
 
 
-/* inHeldPressControlIndex is index into tourBoxPressControlCodes or -1
-   if nothing is held.
-   inControlIndex is index into tourBoxControlCodes */
-void sendUinputSequence( int inHeldPressControlIndex,
-                         int inControlIndex,
-                         ApplicationMapping *inActiveMapping,
-                         int inUinputFile );
+/* returns the ] that closes the bracket expression starting at inOpen,
+   or NULL if it isn't closed
+   A ] right after the [, or after the inNegate character, is part of
+   the expression. */
+const char *findBracketEnd( const char *inOpen, char inNegate );
 
+/* returns how many literal characters inPattern has, counting a
+   bracket expression or escaped character as one, and wildcards and
+   other special characters as none */
+int countLiteralCharacters( const char *inPattern, int inPatternKind );
 
-/* sleeps for a number of milliseconds */
-void msSleep( int inNumMilliseconds );
+/* turns inGlob into an extended regular expression that matches the
+   same whole strings
+   outRegex needs room for 2 * strlen( inGlob ) + 3 characters. */
+void globToRegex( const char *inGlob, char *outRegex );
 
+/* sets inMapping's specificity, and compiles its name into
+   mappingPatterns if it is a re: or glob: pattern
+   returns 1 on success, or 0 if the pattern doesn't compile, in which
+   case inMapping is marked PATTERN_INVALID and never matches */
+char compileMappingPattern( ApplicationMapping *inMapping,
+                            int inLineNumber );
 
-/* track which key presses we have sent as one combo
-   at end of combo, we need to send key releases */
-unsigned short sentPressComboBuffer[ MAX_KEY_SEQUENCE_STEPS ];
+/* fills in mappingsByRank, mappingRanks, and patternMappings */
+void rankMappings( void );
 
-int sentPressComboLength = 0;
+/* returns the field of inWindow named by inMatchField */
+const char *getWindowField( const WindowInfo *inWindow, int inMatchField );
 
-char sentPressComboBufferHeld = 0;
+/* ranks the mappings, and compiles the substring names in appMappings
+   returns 1 on success, 0 if they don't fit in MATCHER_TABLE_SIZE */
+char buildMatcher( void );
 
+/* sets the bit in ioBits for each mapping with inField that matches
+   inString */
+void scanForMatches( const char *inString, int inField,
+                     unsigned int *ioBits );
 
+/* marks the mappings with inField whose names end at inState */
+void markMatcherState( unsigned int inState, int inField,
+                       unsigned int *ioBits );
 
-void sendUinputSequence( int inHeldPressControlIndex,
-                         int inControlIndex,
-                         ApplicationMapping *inActiveMapping,
-                         int inUinputFile ) {
-    int sequenceLength;
-    unsigned short *sequence;
-    int *sleepSequence;
-    int i, p;
-    int lastWasReport = 0;
-    int nextSleepIndex = 0;
+/* finds the mappings that match inWindow, for its title, and for its
+   stable fields too if inStable is 1, for getMatchingMapping to use */
+void findWindowMatches( const WindowInfo *inWindow, char inStable );
 
-    sentPressComboLength = 0;
-    sentPressComboBufferHeld = 0;
-    
-    if( inHeldPressControlIndex == -1 ) {
-        /* extra last element in list is for bare control with nothing
-           else held down */
-        inHeldPressControlIndex = NUM_TOURBOX_PRESS_CONTROLS;
-        }
-    
-    /* get sequence from mapping */
-    sequenceLength = inActiveMapping->
-        keyCodeSequenceLength[ inControlIndex ][ inHeldPressControlIndex ];
 
+/* Returns the first mapping, in rank order, that applies to inTourBoxIndex
+   and matched the window in the last findWindowMatches on one of the
+   fields in inFieldMask, or NULL if there's no match.
+   Mappings from the PROFILE for inTourBoxIndex come before mappings for
+   all TourBoxes.
+   If the search gets to inStableMapping, which must be NULL or a mapping
+   that applies to inTourBoxIndex, it wins from there on, and it is
+   returned instead of NULL. */
+ApplicationMapping *getMatchingMapping( int inTourBoxIndex,
+                                        int inFieldMask,
+                                        ApplicationMapping *inStableMapping );
 
-    if( sequenceLength == 0 ) {
-        /* emtpy sequence, send nothing */
-        return;
+
+
+const char *findBracketEnd( const char *inOpen, char inNegate ) {
+    const char *start = inOpen + 1;
+
+    if( *start == inNegate ) {
+        start++;
         }
-    
-    
-    sequence = inActiveMapping->
-        keyCodeSquence[ inControlIndex ][ inHeldPressControlIndex ];
-    
-    sleepSequence = inActiveMapping->
-        keySequenceSleepsMS[ inControlIndex ][ inHeldPressControlIndex ];
-    
-    /* send it */
-    for( i=0; i<sequenceLength; i++ ) {
-        if( sequence[i] == KEY_RESERVED ) {
-            /* report the end of the press combo , to send them all */
-            uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
+    if( *start == '\0' ) {
+        return NULL;
+        }
+    return strchr( start + 1, ']' );
+    }
 
-            if( sentPressComboLength > 0 ) {
-                /* now send releases for everything in our combo */
 
-                if( i == sequenceLength -1
-                    &&
-                    inActiveMapping->holdLastKeyCombo
-                    [ inControlIndex ][ inHeldPressControlIndex ] ) {
 
-                    /* HOLD at end of sequence, don't release now */
-                    sentPressComboBufferHeld = 1;
-                    }
-                else {
-                    for( p=0; p<sentPressComboLength; p++ ) {
-                        uinputEmit( inUinputFile, EV_KEY,
-                                    sentPressComboBuffer[p], 0 );
-                        }
-                    /* report the end of the release combo */
-                    uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
-                    }
-                
-                /* clear the buffer */
-                sentPressComboLength = 0;
+int countLiteralCharacters( const char *inPattern, int inPatternKind ) {
+    char negate = '^';
+    int count = 0;
+
+    if( inPatternKind != PATTERN_REGEX && inPatternKind != PATTERN_GLOB ) {
+        return (int)strlen( inPattern );
+        }
+    if( inPatternKind == PATTERN_GLOB ) {
+        negate = '!';
+        }
+    
+    while( *inPattern != '\0' ) {
+        const char *end = NULL;
+        
+        if( *inPattern == '[' ) {
+            end = findBracketEnd( inPattern, negate );
+            }
+
+        if( end != NULL ) {
+            count++;
+            inPattern = end;
+            }
+        else if( inPatternKind == PATTERN_GLOB ) {
+            if( *inPattern != '*' && *inPattern != '?' ) {
+                count++;
                 }
-            
-            lastWasReport = 1;
             }
-        else if( sequence[i] == SLEEP_TRIGGER &&
-                 nextSleepIndex < MAX_KEY_SEQUENCE_SLEEPS ) {
-            
-            msSleep( sleepSequence[ nextSleepIndex ] );
-            nextSleepIndex++;
+        else if( *inPattern == '\\' && inPattern[1] != '\0' ) {
+            count++;
+            inPattern++;
             }
-        else if( sequence[i] == MOUSE_SCROLL_UP ) {
-            uinputEmit( inUinputFile, EV_REL, REL_WHEEL, 1 );
-            /* no need for release event, so don't add to sentPressComboBuffer */
-            
-            lastWasReport = 0;
+        else if( *inPattern == '{' && strchr( inPattern, '}' ) != NULL ) {
+            /* a repeat count, like {2,5} */
+            inPattern = strchr( inPattern, '}' );
+            }
+        else if( strchr( ".^$*+?()|", *inPattern ) == NULL ) {
+            count++;
+            }
+        inPattern++;
+        }
+    return count;
+    }
+
+
+
+void globToRegex( const char *inGlob, char *outRegex ) {
+    int length = 0;
+
+    outRegex[ length++ ] = '^';
+    
+    while( *inGlob != '\0' ) {
+        const char *end = NULL;
+        
+        if( *inGlob == '[' ) {
+            end = findBracketEnd( inGlob, '!' );
             }
-        else if( sequence[i] == MOUSE_SCROLL_DOWN ) {
-            uinputEmit( inUinputFile, EV_REL, REL_WHEEL, -1 );
-            /* no need for release event, so don't add to sentPressComboBuffer */
+
+        if( end != NULL ) {
+            outRegex[ length++ ] = '[';
+            inGlob++;
             
-            lastWasReport = 0;
+            if( *inGlob == '!' ) {
+                outRegex[ length++ ] = '^';
+                inGlob++;
+                }
+            while( inGlob != end ) {
+                outRegex[ length++ ] = *inGlob;
+                inGlob++;
+                }
+            outRegex[ length++ ] = ']';
+            }
+        else if( *inGlob == '*' ) {
+            outRegex[ length++ ] = '.';
+            outRegex[ length++ ] = '*';
+            }
+        else if( *inGlob == '?' ) {
+            outRegex[ length++ ] = '.';
             }
         else {
-            uinputEmit( inUinputFile, EV_KEY, sequence[i], 1 );
-            sentPressComboBuffer[ sentPressComboLength ] = sequence[i];
-            sentPressComboLength++;
-            
-            lastWasReport = 0;
+            if( strchr( ".^$+()[]{}|\\", *inGlob ) != NULL ) {
+                outRegex[ length++ ] = '\\';
+                }
+            outRegex[ length++ ] = *inGlob;
             }
+        inGlob++;
         }
+
+    outRegex[ length++ ] = '$';
+    outRegex[ length ] = '\0';
+    }
+
+
+
+char compileMappingPattern( ApplicationMapping *inMapping,
+                            int inLineNumber ) {
+    char globRegex[ 2 * MAX_APPLICATION_NAME_LENGTH + 3 ];
+    const char *regexText = inMapping->name;
+    regex_t *pattern = &( mappingPatterns[ inMapping - appMappings ] );
+    int result;
     
-    if( ! lastWasReport ) {
-        /* final report to send the last key combo */
-        uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
+    inMapping->specificity =
+        countLiteralCharacters( inMapping->name, inMapping->patternKind );
+
+    if( inMapping->patternKind == PATTERN_SUBSTRING ) {
+        return 1;
+        }
 
-        if( sentPressComboLength > 0 ) {
-            /* now send releases for everything in our combo */
+    if( inMapping->patternKind == PATTERN_GLOB ) {
+        globToRegex( inMapping->name, globRegex );
+        regexText = globRegex;
+        }
 
-            if( inActiveMapping->holdLastKeyCombo
-                [ inControlIndex ][ inHeldPressControlIndex ] ) {
+    /* we only need to know whether it matches, not where */
+    result = regcomp( pattern, regexText, REG_EXTENDED | REG_NOSUB );
 
-                /* HOLD at end of sequence, don't release now */
-                sentPressComboBufferHeld = 1;
-                }
-            else {
-                for( p=0; p<sentPressComboLength; p++ ) {
-                    uinputEmit( inUinputFile, EV_KEY,
-                                sentPressComboBuffer[p], 0 );
-                    }
-                /* report the end of the release combo */
-                uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
-                
-                /* clear xcompile
+    if( result != 0 ) {
+        char error[ 128 ];
+        
+        regerror( result, pattern, error, sizeof( error ) );
+        
+        printf( "\nWARNING:\n"
+                "Failed to compile pattern %s\"%s\" on line %d:  %s\n"
+                "Mappings for it will never be used.\n\n",
+                patternKindPrefixes[ inMapping->patternKind ],
+                inMapping->name, inLineNumber, error );
+        
+        inMapping->patternKind = PATTERN_INVALID;
+        return 0;
+        }
+    return 1;
+    }
 
-                   the buffer */
-                sentPressComboLength = 0;
-                }
-            
+
+
+void rankMappings( void ) {
+    /* plain quoted names keep their place in the file, so the first one
+       that matches wins, as always
+       The re: and glob: patterns are sorted among themselves, most
+       specific first, into the places in the file that patterns have. */
+    int sortedPatterns[ MAX_NUM_APPS ];
+    int i, p;
+
+    numPatternMappings = 0;
+    
+    for( i=0; i<numAppMappings; i++ ) {
+        const ApplicationMapping *m = &( appMappings[i] );
+        
+        if( m->patternKind == PATTERN_REGEX ||
+            m->patternKind == PATTERN_GLOB ) {
+            patternMappings[ numPatternMappings ] = i;
+            numPatternMappings++;
+            }
+        else {
+            mappingsByRank[i] = i;
+            mappingRanks[i] = i;
+            }
+        }
+
+    /* an insertion sort, so patterns that are just as specific stay in
+       file order */
+    for( p=0; p<numPatternMappings; p++ ) {
+        int a = patternMappings[p];
+        int j = p;
+
+        while( j > 0 &&
+               appMappings[ sortedPatterns[ j - 1 ] ].specificity <
+               appMappings[a].specificity ) {
+            sortedPatterns[j] = sortedPatterns[ j - 1 ];
+            j--;
             }
+        sortedPatterns[j] = a;
+        }
+    
+    for( p=0; p<numPatternMappings; p++ ) {
+        int rank = patternMappings[p];
         
+        mappingsByRank[ rank ] = sortedPatterns[p];
+        mappingRanks[ sortedPatterns[p] ] = rank;
         }
     }
 
 
-void msSleep( int inNumMilliseconds ) {
-    struct timespec ts;
-    ts.tv_sec = inNumMilliseconds / 1000;
-    ts.tv_nsec = ( inNumMilliseconds % 1000 ) * 1000000;
 
-    nanosleep( &ts, NULL );
+const char *getWindowField( const WindowInfo *inWindow, int inMatchField ) {
+    switch( inMatchField ) {
+        case MATCH_CLASS:
+            return inWindow->wmClass;
+        case MATCH_PROCESS:
+            return inWindow->processName;
+        case MATCH_EXE:
+            return inWindow->exePath;
+        default:
+            return inWindow->title;
+        }
     }
 
+
+
+char buildMatcher( void ) {
+    unsigned int maxStates = 1;
+    unsigned int queueHead = 0;
+    unsigned int queueTail = 0;
+    unsigned int *queue = matcherQueue;
+    int i, c;
     
+    matcherBuilt = 0;
 
+    rankMappings();
 
+    /* classes for every byte that shows up in a name */
+    memset( matcherByteClasses, 0, sizeof( matcherByteClasses ) );
+    matcherNumClasses = 1;
 
-/* processes input byte from TourBox, applying inActiveMapping and generating
-   key events to uinput
-   If inActiveMapping is NULL, we send no uinput, but we still process
-   inputs to track which buttons are held down. */
-void handleTourBoxInput( unsigned char inByte,
-                         ApplicationMapping *inActiveMapping,
-                         int inUinputFile );
+    for( i=0; i<numAppMappings; i++ ) {
+        const unsigned char *name =
+            (const unsigned char *)( appMappings[i].name );
+
+        if( appMappings[i].patternKind != PATTERN_SUBSTRING ) {
+            continue;
+            }
+        
+        while( *name != '\0' ) {
+            if( matcherByteClasses[ *name ] == 0 ) {
+                matcherByteClasses[ *name ] =
+                    (unsigned char)matcherNumClasses;
+                matcherNumClasses++;
+                }
+            maxStates++;
+            name++;
+            }
+        }
 
+    if( (unsigned long)maxStates * (unsigned long)matcherNumClasses >
+        MATCHER_TABLE_SIZE ) {
+        printf( "\nWARNING:\n"
+                "Application names need %lu matcher table entries, but "
+                "MATCHER_TABLE_SIZE is only %d.  "
+                "Checking names one at a time instead.\n\n",
+                (unsigned long)maxStates * (unsigned long)matcherNumClasses,
+                MATCHER_TABLE_SIZE );
+        return 0;
+        }
 
-/* index into tourBoxPressControlCodes for what button is held
-   If multiple buttons are held, the oldest one wins.
-*/
-int heldPressControlIndex = -1;
+    
+    /* build the trie of names, where a 0 transition means no child,
+       since nothing points back to the root yet */
+    matcherNumStates = 1;
+    memset( matcherTransitions, 0,
+            maxStates * (unsigned int)matcherNumClasses *
+            sizeof( matcherTransitions[0] ) );
+    matcherFirstMapping[0] = -1;
+    
+    for( i=0; i<numAppMappings; i++ ) {
+        const unsigned char *name =
+            (const unsigned char *)( appMappings[i].name );
+        unsigned int state = 0;
+        int *last;
 
+        if( appMappings[i].patternKind != PATTERN_SUBSTRING ) {
+            continue;
+            }
+        
+        while( *name != '\0' ) {
+            unsigned int *next =
+                &( matcherTransitions[ state * (unsigned int)matcherNumClasses
+                                       + matcherByteClasses[ *name ] ] );
+            if( *next == 0 ) {
+                *next = matcherNumStates;
+                matcherFirstMapping[ matcherNumStates ] = -1;
+                matcherNumStates++;
+                }
+            state = *next;
+            name++;
+            }
 
-void handleTourBoxInput( unsigned char inByte,
-                         ApplicationMapping *inActiveMapping,
-                         int inUinputFile ) {
-    unsigned char controlCode;
-    unsigned char actionCode;
+        /* keep mappings with the same name in file order */
+        last = &( matcherFirstMapping[ state ] );
+        while( *last != -1 ) {
+            last = &( matcherNextMapping[ *last ] );
+            }
+        *last = i;
+        matcherNextMapping[i] = -1;
+        }
+
+    
+    /* breadth first, so each state's fail state is done before it, and
+       fill in the missing transitions from the fail states */
+    matcherFail[0] = 0;
+    matcherOutputLink[0] = 0;
+    
+    for( c=0; c<matcherNumClasses; c++ ) {
+        unsigned int child = matcherTransitions[c];
+        
+        if( child != 0 ) {
+            matcherFail[ child ] = 0;
+            matcherOutputLink[ child ] = 0;
+            queue[ queueTail ] = child;
+            queueTail++;
+            }
+        }
+
+    while( queueHead < queueTail ) {
+        unsigned int state = queue[ queueHead ];
+        unsigned int *row =
+            &( matcherTransitions[ state * (unsigned int)matcherNumClasses ] );
+        unsigned int *failRow =
+            &( matcherTransitions[ matcherFail[ state ] *
+                                   (unsigned int)matcherNumClasses ] );
+        queueHead++;
+        
+        for( c=0; c<matcherNumClasses; c++ ) {
+            unsigned int child = row[c];
+            
+            if( child != 0 ) {
+                unsigned int fail = failRow[c];
+                
+                matcherFail[ child ] = fail;
+
+                if( matcherFirstMapping[ fail ] != -1 && fail != 0 ) {
+                    matcherOutputLink[ child ] = fail;
+                    }
+                else {
+                    matcherOutputLink[ child ] = matcherOutputLink[ fail ];
+                    }
+                
+                queue[ queueTail ] = child;
+                queueTail++;
+                }
+            else {
+                row[c] = failRow[c];
+                }
+            }
+        }
+
+    matcherBuilt = 1;
+    return 1;
+    }
 
-    int controlIndex = -1;
-    int pressIndex = -1;
-    int turnWidgetIndex = -1;
+
+
+void markMatcherState( unsigned int inState, int inField,
+                       unsigned int *ioBits ) {
     int i;
+
+    for( i = matcherFirstMapping[ inState ];
+         i != -1;
+         i = matcherNextMapping[i] ) {
+        
+        if( appMappings[i].matchField == inField ) {
+            int rank = mappingRanks[i];
+            
+            ioBits[ rank / 32 ] |= 1U << ( rank % 32 );
+            }
+        }
+    }
+
+
+
+void scanForMatches( const char *inString, int inField,
+                     unsigned int *ioBits ) {
+    const unsigned char *nextByte = (const unsigned char *)inString;
+    unsigned int state = 0;
+    unsigned int numClasses = (unsigned int)matcherNumClasses;
+
+    /* empty names match everything */
+    markMatcherState( 0, inField, ioBits );
     
+    while( *nextByte != '\0' ) {
+        unsigned int output;
+        
+        state = matcherTransitions[ state * numClasses +
+                                    matcherByteClasses[ *nextByte ] ];
+        nextByte++;
 
-    /* strip out first 6 bits to get control code */
-    controlCode = inByte & 0x3F;
-    /* last two bits */
-    actionCode = inByte & 0xC0;
+        output = state;
+        if( matcherFirstMapping[ output ] == -1 ) {
+            output = matcherOutputLink[ output ];
+            }
+        while( output != 0 ) {
+            markMatcherState( output, inField, ioBits );
+            output = matcherOutputLink[ output ];
+            }
+        }
+    }
 
-    /* first, search for match for our whole byte
-       since turn controls map using the whole byte */
-    for( i=0; i<NUM_TOURBOX_CONTROLS; i++ ) {
-        if( tourBoxControlCodes[i] == inByte ) {
-            controlIndex = i;
-            break;
+
+
+void findWindowMatches( const WindowInfo *inWindow, char inStable ) {
+    int i;
+    
+    memset( titleMatchBits, 0, sizeof( titleMatchBits ) );
+
+    if( inStable ) {
+        memset( stableMatchBits, 0, sizeof( stableMatchBits ) );
+        }
+
+    if( matcherBuilt ) {
+        if( numTitleMappings > 0 ) {
+            scanForMatches( inWindow->title, MATCH_TITLE, titleMatchBits );
+            }
+        if( inStable ) {
+            scanForMatches( inWindow->wmClass, MATCH_CLASS,
+                            stableMatchBits );
+            scanForMatches( inWindow->processName, MATCH_PROCESS,
+                            stableMatchBits );
+            scanForMatches( inWindow->exePath, MATCH_EXE,
+                            stableMatchBits );
             }
         }
-    if( controlIndex == -1 ) {
-        /* no mapping for whole byte
-           this is not a turn control
-           check again using only the controlCode portion of the byte */
-        for( i=0; i<NUM_TOURBOX_CONTROLS; i++ ) {
-            if( tourBoxControlCodes[i] == controlCode ) {
-                controlIndex = i;
-                break;
+    else {
+        for( i=0; i<numAppMappings; i++ ) {
+            const ApplicationMapping *m = &( appMappings[i] );
+            unsigned int *bits = stableMatchBits;
+            int rank = mappingRanks[i];
+            
+            if( m->matchField == MATCH_TITLE ) {
+                bits = titleMatchBits;
+                }
+            
+            if( m->patternKind == PATTERN_SUBSTRING &&
+                ( bits == titleMatchBits || inStable ) &&
+                contains( getWindowField( inWindow, m->matchField ),
+                          m->name ) ) {
+                bits[ rank / 32 ] |= 1U << ( rank % 32 );
                 }
             }
         }
 
-    if( controlIndex == -1 ) {
-        printf( "Failed to extract known control code "
-                "from TourBox input byte 0x%02X\n", inByte );
+    for( i=0; i<numPatternMappings; i++ ) {
+        int a = patternMappings[i];
+        const ApplicationMapping *m = &( appMappings[a] );
+        unsigned int *bits = stableMatchBits;
+        int rank = mappingRanks[a];
+
+        if( m->matchField == MATCH_TITLE ) {
+            bits = titleMatchBits;
+            }
+
+        if( ( bits == titleMatchBits || inStable ) &&
+            regexec( &( mappingPatterns[a] ),
+                     getWindowField( inWindow, m->matchField ),
+                     0, NULL, 0 ) == 0 ) {
+            bits[ rank / 32 ] |= 1U << ( rank % 32 );
+            }
+        }
+    }
+
+
+
+ApplicationMapping *getMatchingMapping( int inTourBoxIndex,
+                                        int inFieldMask,
+                                        ApplicationMapping *inStableMapping ) {
+    int pass;
+    int w;
+
+    for( pass=0; pass<2; pass++ ) {
+        int profile = inTourBoxIndex;
+        int stopIndex = numAppMappings;
+
+        if( pass == 1 ) {
+            profile = ALL_TOURBOXES;
+            }
+        if( inStableMapping != NULL &&
+            inStableMapping->tourBoxIndex == profile ) {
+            stopIndex = mappingRanks[ inStableMapping - appMappings ];
+            }
+
+        /* only look at mappings that matched, a word of them at a time,
+           in rank order
+           A mapping's bit is only ever set in the bits for its own kind
+           of field, so the field check sorts out which bits count. */
+        for( w=0; w * 32 < stopIndex; w++ ) {
+            unsigned int bits = titleMatchBits[w] | stableMatchBits[w];
+            int i = w * 32;
+            
+            while( bits != 0 && i < stopIndex ) {
+                if( bits & 1 ) {
+                    ApplicationMapping *m =
+                        &( appMappings[ mappingsByRank[i] ] );
+                    
+                    if( m->tourBoxIndex == profile &&
+                        ( inFieldMask & ( 1 << m->matchField ) ) ) {
+                        return m;
+                        }
+                    }
+                bits >>= 1;
+                i++;
+                }
+            }
+
+        if( stopIndex < numAppMappings ) {
+            return inStableMapping;
+            }
+        }
+    return NULL;
+    }
+
+
+
+/* returns a monotonic timestamp in milliseconds, for measuring intervals */
+double getCurrentTimeMS( void );
+
+
+double getCurrentTimeMS( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+    }
+
+
+
+/* prints the driver's virtual and resident memory footprint */
+void printMemoryFootprint( void );
+
+
+void printMemoryFootprint( void ) {
+    char line[ 128 ];
+    FILE *status = fopen( "/proc/self/status", "r" );
+
+    if( status == NULL ) {
         return;
         }
     
-    
-    for( i=0; i<NUM_TOURBOX_PRESS_CONTROLS; i++ ) {
-        if( tourBoxPressControlCodes[i] == controlCode ) {
-            pressIndex = i;
-            break;
+    while( fgets( line, sizeof( line ), status ) != NULL ) {
+        if( startsWith( line, "VmSize:" ) ||
+            startsWith( line, "VmRSS:" ) ) {
+            printf( "    %s", line );
             }
         }
-    if( pressIndex == -1 ) {
-        for( i=0; i<NUM_TOURBOX_TURN_WIDGETS; i++ ) {
-            if( tourBoxTurnWidgets[i] == controlCode ) {
-                turnWidgetIndex = i;
-                break;
-                }
+    fclose( status );
+    }
+
+
+
+/* Setup messages.
+   Each mapping's setup message is built once, when the settings file is
+   loaded, along with the default one that turns haptics off.  Switching
+   mappings only sends a message when its bytes differ from what the
+   TourBox already has, and the send happens in the background, through
+   the main event loop, so it never holds up input. */
+
+
+unsigned char tourBoxSetupMessage[ TOURBOX_SETUP_MESSAGE_LENGTH ] = {
+    0xb5, 0x00, 0x5d, 0x04, 0x00, 0x05, 0x00, 0x06,
+    0x00, 0x07, 0x00, 0x08, 0x00, 0x09, 0x00, 0x0b,
+    0x00, 0x0c, 0x00, 0x0d, 0x00, 0x0e, 0x00, 0x0f,
+    0x00, 0x26, 0x00, 0x27, 0x00, 0x28, 0x00, 0x29,
+    0x00, 0x3b, 0x00, 0x3c, 0x00, 0x3d, 0x00, 0x3e,
+    0x00, 0x3f, 0x00, 0x40, 0x00, 0x41, 0x00, 0x42,
+    0x00, 0x43, 0x00, 0x44, 0x00, 0x45, 0x00, 0x46,
+    0x00, 0x47, 0x00, 0x48, 0x00, 0x49, 0x00, 0x4a,
+    0x00, 0x4b, 0x00, 0x4c, 0x00, 0x4d, 0x00, 0x4e,
+    0x00, 0x4f, 0x00, 0x50, 0x00, 0x51, 0x00, 0x52,
+    0x00, 0x53, 0x00, 0x54, 0x00, 0xa8, 0x00, 0xa9,
+    0x00, 0xaa, 0x00, 0xab, 0x00, 0xfe };
+
+
+/* haptics turned off for all controls */
+unsigned char defaultSetupMessage[ TOURBOX_SETUP_MESSAGE_LENGTH ];
+
+
+/* indexed by 0, 1, 2 for Off, Weak, Strong haptics */
+unsigned char hapticStrengthBits[3] = { 0, 4, 8 };
+
+/* indexed by 0, 1, 2 for Slow, Medium, Fast rotation */
+unsigned char rotationSpeedBits[3] = { 2, 1, 0 };
+
+
+unsigned long setupStatSent = 0;
+unsigned long setupStatSkipped = 0;
+
+/* how long setup message sends took, and TourBox handshakes */
+unsigned long setupStatDone = 0;
+double setupStatTotalMS = 0;
+double setupStatMaxMS = 0;
+
+unsigned long handshakeStatDone = 0;
+double handshakeStatTotalMS = 0;
+double handshakeStatMaxMS = 0;
+
+
+/* fills outMessage with the setup message for inMapping, or the default
+   setup message if inMapping is NULL */
+void buildSetupMessage( ApplicationMapping *inMapping,
+                        unsigned char *outMessage );
+
+/* builds defaultSetupMessage and the setupMessage of every mapping
+   call once the settings file is loaded */
+void buildAllSetupMessages( void );
+
+/* starts sending inMessage to an open TourBox, unless it already has it
+   returns 1 on success, 0 on failure.*/
+char sendSetupMessage( TourBoxDevice *inDevice,
+                       const unsigned char *inMessage );
+
+/* sends the setup message for inMapping, or the default one if inMapping
+   is NULL, to an open TourBox, unless it already has it
+   Failures after the send starts mark the TourBox lost.
+   returns 1 on success, 0 on failure.*/
+char sendTourBoxSetup( TourBoxDevice *inDevice,
+                       ApplicationMapping *inMapping );
+
+/* call when a send started by transport->sendSetup is done */
+void noteSetupMessageDone( TourBoxDevice *inDevice, char inSuccess );
+
+
+
+void buildSetupMessage( ApplicationMapping *inMapping,
+                        unsigned char *outMessage ) {
+    int t;
+    int p;
+    int setupIndex;
+    
+    memcpy( outMessage, tourBoxSetupMessage, TOURBOX_SETUP_MESSAGE_LENGTH );
+    
+    for( t=0; t < NUM_TOURBOX_TURN_WIDGETS; t++ ) {
+        /* 1 extra mapping (p <=) for turn widget with no modifier */
+        for( p=0; p <= NUM_TOURBOX_PRESS_CONTROLS; p++ ) {
+
+            setupIndex = tourBoxSetupMap[t][p];
+
+            if( inMapping == NULL ) {
+                outMessage[ setupIndex ] = 0;
+                }
+            else {
+                outMessage[ setupIndex ] = (unsigned char)(
+                    hapticStrengthBits[ inMapping->hapticStrength[t][p] ] |
+                    rotationSpeedBits[ inMapping->rotationSpeed[t][p] ] );
+                }
+            }
+        }
+    }
+
+
+
+void buildAllSetupMessages( void ) {
+    int i;
+    
+    buildSetupMessage( NULL, defaultSetupMessage );
+
+    for( i=0; i<numAppMappings; i++ ) {
+        buildSetupMessage( &( appMappings[i] ), appMappings[i].setupMessage );
+        }
+    }
+
+
+
+char sendSetupMessage( TourBoxDevice *inDevice,
+                       const unsigned char *inMessage ) {
+    
+    memcpy( inDevice->setupBuffer, inMessage, TOURBOX_SETUP_MESSAGE_LENGTH );
+
+    /* a transport that sends right away calls noteSetupMessageDone
+       before sendSetup returns, so everything must be ready first */
+    memcpy( inDevice->sentSetupMessage, inMessage,
+            TOURBOX_SETUP_MESSAGE_LENGTH );
+    inDevice->setupKnown = 1;
+    inDevice->setupStartMS = getCurrentTimeMS();
+    
+    if( ! transport->sendSetup( inDevice ) ) {
+        inDevice->setupKnown = 0;
+        return 0;
+        }
+    
+    setupStatSent++;
+    return 1;
+    }
+
+
+
+char sendTourBoxSetup( TourBoxDevice *inDevice,
+                       ApplicationMapping *inMapping ) {
+    const unsigned char *message = defaultSetupMessage;
+    const unsigned char *latest = inDevice->sentSetupMessage;
+    
+    if( inMapping != NULL ) {
+        message = inMapping->setupMessage;
+        }
+    
+    if( inDevice->setupPending ) {
+        latest = inDevice->pendingSetupMessage;
+        }
+    
+    if( ( inDevice->setupKnown || inDevice->setupPending ) &&
+        memcmp( latest, message, TOURBOX_SETUP_MESSAGE_LENGTH ) == 0 ) {
+        /* TourBox has these haptics already, or will soon */
+        setupStatSkipped++;
+        return 1;
+        }
+
+    if( inDevice->setupInFlight ) {
+        /* send it after, replacing anything else waiting to go */
+        memcpy( inDevice->pendingSetupMessage, message,
+                TOURBOX_SETUP_MESSAGE_LENGTH );
+        inDevice->setupPending = 1;
+        return 1;
+        }
+    
+    return sendSetupMessage( inDevice, message );
+    }
+
+
+
+void noteSetupMessageDone( TourBoxDevice *inDevice, char inSuccess ) {
+    double sendMS = getCurrentTimeMS() - inDevice->setupStartMS;
+    
+    inDevice->setupInFlight = 0;
+
+    if( ! inSuccess ) {
+        printf( "Failed to send setup message to TourBox %s\n",
+                getTourBoxLabel( inDevice ) );
+        inDevice->setupKnown = 0;
+        inDevice->setupPending = 0;
+        noteTourBoxLost( inDevice );
+        return;
+        }
+
+    setupStatDone++;
+    setupStatTotalMS += sendMS;
+    if( sendMS > setupStatMaxMS ) {
+        setupStatMaxMS = sendMS;
+        }
+    
+    if( inDevice->setupPending ) {
+        inDevice->setupPending = 0;
+        
+        if( memcmp( inDevice->pendingSetupMessage,
+                    inDevice->sentSetupMessage,
+                    TOURBOX_SETUP_MESSAGE_LENGTH ) == 0 ) {
+            /* switched back before the last send finished */
+            setupStatSkipped++;
+            }
+        else if( ! sendSetupMessage( inDevice,
+                                     inDevice->pendingSetupMessage ) ) {
+            printf( "Failed to send setup message to TourBox %s\n",
+                    getTourBoxLabel( inDevice ) );
+            noteTourBoxLost( inDevice );
+            }
+        }
+    }
+
+
+/* uinput events waiting to be written by flushUinputEvents
+   Only touched by the executor thread. */
+struct input_event uinputBatch[ UINPUT_BATCH_SIZE ];
+
+int numUinputBatchEvents = 0;
+
+/* how many events fill up uinputBatch, normally UINPUT_BATCH_SIZE, but
+   benchmarkUinputBatching lowers it to compare */
+int uinputBatchLimit = UINPUT_BATCH_SIZE;
+
+/* how many times we've written to /dev/uinput */
+unsigned long uinputWriteCount = 0;
+
+/* how many turns were sent together with repeats of themselves */
+unsigned long queueStatBatchedTurns = 0;
+
+/* how often PACE settings held back a key combo, or a turn */
+unsigned long paceStatComboWaits = 0;
+unsigned long paceStatTurnWaits = 0;
+
+
+/* emit a uinput event
+   It is gathered up with other events, and only written when
+   flushUinputEvents is called, or uinputBatch fills up. */
+void uinputEmit( int inUinputFile, unsigned short inType,
+                 unsigned short inCode, int inVal );
+
+/* writes the events gathered by uinputEmit */
+void flushUinputEvents( int inUinputFile );
+
+/* emits inNumEvents events at once, like calling uinputEmit for each */
+void uinputEmitEvents( int inUinputFile,
+                       const struct input_event *inEvents, int inNumEvents );
+
+
+
+void uinputEmit( int inUinputFile, unsigned short inType,
+                 unsigned short inCode, int inVal ) {
+    struct input_event *event = &( uinputBatch[ numUinputBatchEvents ] );
+
+    event->type = inType;
+    event->code = inCode;
+    event->value = inVal;
+    /* timestamp values below are ignored */
+    event->time.tv_sec = 0;
+    event->time.tv_usec = 0;
+
+    numUinputBatchEvents++;
+
+    if( numUinputBatchEvents >= uinputBatchLimit ) {
+        flushUinputEvents( inUinputFile );
+        }
+    }
+
+
+
+void uinputEmitEvents( int inUinputFile,
+                       const struct input_event *inEvents, int inNumEvents ) {
+    while( inNumEvents > 0 ) {
+        int numToCopy = uinputBatchLimit - numUinputBatchEvents;
+
+        if( numToCopy > inNumEvents ) {
+            numToCopy = inNumEvents;
+            }
+        memcpy( &( uinputBatch[ numUinputBatchEvents ] ), inEvents,
+                (size_t)numToCopy * sizeof( struct input_event ) );
+        
+        numUinputBatchEvents += numToCopy;
+        inEvents += numToCopy;
+        inNumEvents -= numToCopy;
+        
+        if( numUinputBatchEvents >= uinputBatchLimit ) {
+            flushUinputEvents( inUinputFile );
+            }
+        }
+    }
+
+
+
+void flushUinputEvents( int inUinputFile ) {
+    if( numUinputBatchEvents == 0 ) {
+        return;
+        }
+    
+    write( inUinputFile, uinputBatch,
+           (size_t)numUinputBatchEvents * sizeof( struct input_event ) );
+    uinputWriteCount++;
+    
+    numUinputBatchEvents = 0;
+    }
+
+
+
+/* Compiled key sequences.
+   Each key sequence in the settings file is compiled into a program of
+   PROGRAM_ ops, which sends events rendered into programEvents ahead of
+   time, with the waits and HOLD between them. */
+
+/* sends numEvents events from programEvents */
+#define PROGRAM_EMIT         0
+/* a SLEEP_ trigger, for value milliseconds */
+#define PROGRAM_SLEEP        1
+/* a key combo starts, waiting for PACE GAP first */
+#define PROGRAM_COMBO_START  2
+/* a key combo is done, for PACE GAP */
+#define PROGRAM_COMBO_END    3
+/* HOLD, keeping numEvents events from programEvents to release the held
+   combo when the TourBox control is released */
+#define PROGRAM_HOLD         4
+
+typedef struct ProgramOp {
+        /* one of the PROGRAM_ values above */
+        unsigned char kind;
+
+        /* for PROGRAM_SLEEP */
+        int value;
+
+        /* for PROGRAM_EMIT and PROGRAM_HOLD, where its events are,
+           counting from the firstEvent of its action */
+        int firstEvent;
+        int numEvents;
+    } ProgramOp;
+
+
+/* a key sequence has fewer ops than events, except for sleeps */
+ProgramOp programOps[ MAX_PROGRAM_EVENTS ];
+
+int numProgramOps = 0;
+
+struct input_event programEvents[ MAX_PROGRAM_EVENTS ];
+
+int numProgramEvents = 0;
+
+
+CompiledAction compiledActions[ MAX_COMPILED_ACTIONS ];
+
+int numCompiledActions = 0;
+
+/* for finding identical compiledActions to share
+   compiledActionBuckets holds the first index into compiledActions with
+   each hash (mod MAX_COMPILED_ACTIONS), and compiledActionNext the next
+   one with the same hash, or -1 */
+int compiledActionBuckets[ MAX_COMPILED_ACTIONS ];
+int compiledActionNext[ MAX_COMPILED_ACTIONS ];
+
+
+/* empties compiledActions and the program they use */
+void clearCompiledActions( void );
+
+/* fills the actions table of every mapping
+   call once the settings file is loaded */
+void compileAllActions( void );
+
+/* compiles a key sequence from the settings file, returning a compiled
+   action identical to it, which might be one compiled earlier, or NULL
+   if compiledActions or the program is full */
+const CompiledAction *findOrAddCompiledAction( const unsigned short *inSteps,
+                                               int inNumSteps,
+                                               const int *inSleepsMS,
+                                               char inHold );
+
+/* compiles a key sequence into outAction, adding its ops and events to
+   the end of programOps and programEvents
+   The events are the same ones sendUinputSequence always sent for it.
+   returns 1 on success, or 0 if the program is full */
+char compileProgram( const unsigned short *inSteps, int inNumSteps,
+                     const int *inSleepsMS, char inHold,
+                     CompiledAction *outAction );
+
+/* for compileProgram, adds an op to the end of ioAction
+   returns the op, or NULL if programOps is full */
+ProgramOp *addProgramOp( CompiledAction *ioAction, unsigned char inKind );
+
+/* for compileProgram, adds an event to the end of ioAction, to be sent
+   by a PROGRAM_EMIT op
+   returns 1 on success, or 0 if the program is full */
+char addProgramEvent( CompiledAction *ioAction, unsigned short inType,
+                      unsigned short inCode, int inValue );
+
+/* for compileProgram, adds a PROGRAM_HOLD op to the end of ioAction, for
+   the inNumPressed keys in inPressed
+   returns 1 on success, or 0 if the program is full */
+char addProgramHold( CompiledAction *ioAction,
+                     const unsigned short *inPressed, int inNumPressed );
+
+/* FNV-1a hash of the ops and events of inAction */
+unsigned int hashCompiledAction( const CompiledAction *inAction );
+
+/* returns 1 if inA and inB have the same ops and events */
+char sameCompiledActions( const CompiledAction *inA,
+                          const CompiledAction *inB );
+
+
+
+void clearCompiledActions( void ) {
+    int i;
+    
+    numCompiledActions = 0;
+    numProgramOps = 0;
+    numProgramEvents = 0;
+    
+    for( i=0; i<MAX_COMPILED_ACTIONS; i++ ) {
+        compiledActionBuckets[i] = -1;
+        }
+    }
+
+
+
+void compileAllActions( void ) {
+    int i, c, h;
+    int numSkipped = 0;
+
+    clearCompiledActions();
+    
+    for( i=0; i<numAppMappings; i++ ) {
+        ApplicationMapping *m = &( appMappings[i] );
+        
+        for( c=0; c<NUM_TOURBOX_CONTROLS; c++ ) {
+            /* the sequence arrays have nothing held last, but the
+               actions table has it first */
+            for( h=0; h<=NUM_TOURBOX_PRESS_CONTROLS; h++ ) {
+                int actionsH = ( h + 1 ) % ( NUM_TOURBOX_PRESS_CONTROLS + 1 );
+                
+                m->actions[ actionsH ][c] = NULL;
+
+                if( m->keyCodeSequenceLength[c][h] == 0 ) {
+                    continue;
+                    }
+                
+                m->actions[ actionsH ][c] =
+                    findOrAddCompiledAction( m->keyCodeSquence[c][h],
+                                             m->keyCodeSequenceLength[c][h],
+                                             m->keySequenceSleepsMS[c][h],
+                                             m->holdLastKeyCombo[c][h] );
+
+                if( m->actions[ actionsH ][c] == NULL ) {
+                    numSkipped++;
+                    }
+                }
+            }
+        }
+    
+    if( numSkipped > 0 ) {
+        printf( "\nWARNING:\n"
+                "Settings file has more different key sequences than "
+                "MAX_COMPILED_ACTIONS (%d) or MAX_PROGRAM_EVENTS (%d) "
+                "can hold, skipping %d of them.\n\n",
+                MAX_COMPILED_ACTIONS, MAX_PROGRAM_EVENTS, numSkipped );
+        }
+    }
+
+
+
+const CompiledAction *findOrAddCompiledAction( const unsigned short *inSteps,
+                                               int inNumSteps,
+                                               const int *inSleepsMS,
+                                               char inHold ) {
+    CompiledAction *action;
+    unsigned int bucket;
+    int a;
+
+    if( numCompiledActions >= MAX_COMPILED_ACTIONS ) {
+        return NULL;
+        }
+
+    /* compile it into the next free spot, then see if we had it already */
+    action = &( compiledActions[ numCompiledActions ] );
+    
+    if( ! compileProgram( inSteps, inNumSteps, inSleepsMS, inHold,
+                          action ) ) {
+        return NULL;
+        }
+    
+    bucket = hashCompiledAction( action ) % MAX_COMPILED_ACTIONS;
+    
+    for( a = compiledActionBuckets[ bucket ]; a != -1;
+         a = compiledActionNext[a] ) {
+        
+        if( sameCompiledActions( &( compiledActions[a] ), action ) ) {
+            /* give back the program space we just used */
+            numProgramOps = action->firstOp;
+            numProgramEvents = action->firstEvent;
+            return &( compiledActions[a] );
+            }
+        }
+
+    a = numCompiledActions;
+    numCompiledActions++;
+    
+    compiledActionNext[a] = compiledActionBuckets[ bucket ];
+    compiledActionBuckets[ bucket ] = a;
+    
+    return action;
+    }
+
+
+
+char compileProgram( const unsigned short *inSteps, int inNumSteps,
+                     const int *inSleepsMS, char inHold,
+                     CompiledAction *outAction ) {
+    /* keys pressed in the current combo, to release at its end */
+    unsigned short pressed[ MAX_KEY_SEQUENCE_STEPS ];
+    int numPressed = 0;
+    char lastWasReport = 0;
+    char onlyScrolls = 1;
+    int nextSleepIndex = 0;
+    char ok = 1;
+    int i, p;
+
+    outAction->firstOp = numProgramOps;
+    outAction->numOps = 0;
+    outAction->firstEvent = numProgramEvents;
+    outAction->numEvents = 0;
+    outAction->repeatKind = REPEAT_KEYS;
+    outAction->scrollPerSend = 0;
+
+    if( inHold ) {
+        outAction->repeatKind = REPEAT_ONE_AT_A_TIME;
+        }
+    
+    for( i=0; i<inNumSteps && ok; i++ ) {
+        unsigned short step = inSteps[i];
+        
+        if( step == KEY_RESERVED ) {
+            /* report the end of the press combo, to send them all */
+            ok = addProgramEvent( outAction, EV_SYN, SYN_REPORT, 0 );
+
+            if( numPressed > 0 ) {
+                if( i == inNumSteps - 1 && inHold ) {
+                    /* HOLD at end of sequence, don't release now
+                       The combo was always forgotten here, so there's
+                       nothing left to release later but the report. */
+                    ok = ok && addProgramHold( outAction, pressed, 0 );
+                    }
+                else {
+                    for( p=0; p<numPressed; p++ ) {
+                        ok = ok && addProgramEvent( outAction, EV_KEY,
+                                                    pressed[p], 0 );
+                        }
+                    /* report the end of the release combo */
+                    ok = ok && addProgramEvent( outAction, EV_SYN,
+                                                SYN_REPORT, 0 );
+                    }
+                numPressed = 0;
+                }
+            
+            ok = ok && ( addProgramOp( outAction, PROGRAM_COMBO_END )
+                         != NULL );
+            lastWasReport = 1;
+            }
+        else if( step == SLEEP_TRIGGER &&
+                 nextSleepIndex < MAX_KEY_SEQUENCE_SLEEPS ) {
+            ProgramOp *op = addProgramOp( outAction, PROGRAM_SLEEP );
+
+            if( op == NULL ) {
+                ok = 0;
+                }
+            else {
+                op->value = inSleepsMS[ nextSleepIndex ];
+                }
+            nextSleepIndex++;
+            outAction->repeatKind = REPEAT_ONE_AT_A_TIME;
+            }
+        else {
+            if( i == 0 || lastWasReport ) {
+                ok = ( addProgramOp( outAction, PROGRAM_COMBO_START )
+                       != NULL );
+                }
+            
+            if( step == MOUSE_SCROLL_UP || step == MOUSE_SCROLL_DOWN ) {
+                /* no need for release event, so don't add to pressed */
+                int direction = ( step == MOUSE_SCROLL_UP ) ? 1 : -1;
+                
+                ok = ok && addProgramEvent( outAction, EV_REL, REL_WHEEL,
+                                            direction );
+                outAction->scrollPerSend += direction;
+                }
+            else {
+                ok = ok && addProgramEvent( outAction, EV_KEY, step, 1 );
+                pressed[ numPressed ] = step;
+                numPressed++;
+                onlyScrolls = 0;
+                }
+            lastWasReport = 0;
+            }
+        }
+    
+    if( ok && ! lastWasReport ) {
+        /* final report to send the last key combo */
+        ok = addProgramEvent( outAction, EV_SYN, SYN_REPORT, 0 );
+
+        if( numPressed > 0 ) {
+            if( inHold ) {
+                /* HOLD at end of sequence, don't release now */
+                ok = ok && addProgramHold( outAction, pressed, numPressed );
+                }
+            else {
+                for( p=0; p<numPressed; p++ ) {
+                    ok = ok && addProgramEvent( outAction, EV_KEY,
+                                                pressed[p], 0 );
+                    }
+                /* report the end of the release combo */
+                ok = ok && addProgramEvent( outAction, EV_SYN,
+                                            SYN_REPORT, 0 );
+                }
+            }
+        }
+    
+    ok = ok && ( addProgramOp( outAction, PROGRAM_COMBO_END ) != NULL );
+
+    if( ! ok ) {
+        numProgramOps = outAction->firstOp;
+        numProgramEvents = outAction->firstEvent;
+        return 0;
+        }
+    
+    if( onlyScrolls && outAction->repeatKind == REPEAT_KEYS ) {
+        outAction->repeatKind = REPEAT_SCROLL;
+        }
+    return 1;
+    }
+
+
+
+ProgramOp *addProgramOp( CompiledAction *ioAction, unsigned char inKind ) {
+    ProgramOp *op;
+    
+    if( numProgramOps >= MAX_PROGRAM_EVENTS ) {
+        return NULL;
+        }
+    op = &( programOps[ numProgramOps ] );
+    numProgramOps++;
+    ioAction->numOps++;
+
+    /* zeroed, padding too, so sameCompiledActions can compare ops whole */
+    memset( op, 0, sizeof( ProgramOp ) );
+    op->kind = inKind;
+    op->firstEvent = ioAction->numEvents;
+    
+    return op;
+    }
+
+
+
+char addProgramEvent( CompiledAction *ioAction, unsigned short inType,
+                      unsigned short inCode, int inValue ) {
+    struct input_event *event;
+    ProgramOp *lastOp = NULL;
+    
+    if( numProgramEvents >= MAX_PROGRAM_EVENTS ) {
+        return 0;
+        }
+    
+    if( ioAction->numOps > 0 ) {
+        lastOp = &( programOps[ numProgramOps - 1 ] );
+        }
+    if( lastOp == NULL || lastOp->kind != PROGRAM_EMIT ) {
+        /* start a new block of events */
+        lastOp = addProgramOp( ioAction, PROGRAM_EMIT );
+
+        if( lastOp == NULL ) {
+            return 0;
+            }
+        }
+    
+    event = &( programEvents[ numProgramEvents ] );
+    numProgramEvents++;
+    ioAction->numEvents++;
+    lastOp->numEvents++;
+    
+    /* timestamp values are ignored */
+    memset( event, 0, sizeof( struct input_event ) );
+    event->type = inType;
+    event->code = inCode;
+    event->value = inValue;
+    
+    return 1;
+    }
+
+
+
+char addProgramHold( CompiledAction *ioAction,
+                     const unsigned short *inPressed, int inNumPressed ) {
+    ProgramOp *op = addProgramOp( ioAction, PROGRAM_HOLD );
+    int p;
+    
+    if( op == NULL ||
+        numProgramEvents + inNumPressed + 1 > MAX_PROGRAM_EVENTS ) {
+        return 0;
+        }
+
+    /* the releases go right after the events, not in a PROGRAM_EMIT
+       block, so they aren't sent now */
+    for( p=0; p<=inNumPressed; p++ ) {
+        struct input_event *event = &( programEvents[ numProgramEvents ] );
+
+        memset( event, 0, sizeof( struct input_event ) );
+        if( p < inNumPressed ) {
+            event->type = EV_KEY;
+            event->code = inPressed[p];
+            }
+        else {
+            /* report the end of the release combo */
+            event->type = EV_SYN;
+            event->code = SYN_REPORT;
+            }
+        numProgramEvents++;
+        ioAction->numEvents++;
+        op->numEvents++;
+        }
+    return 1;
+    }
+
+
+
+unsigned int hashCompiledAction( const CompiledAction *inAction ) {
+    unsigned int hash = 2166136261U;
+    int i;
+    
+    for( i=0; i<inAction->numOps; i++ ) {
+        const ProgramOp *op = &( programOps[ inAction->firstOp + i ] );
+        
+        hash ^= op->kind;
+        hash *= 16777619U;
+        hash ^= (unsigned int)op->value;
+        hash *= 16777619U;
+        }
+    for( i=0; i<inAction->numEvents; i++ ) {
+        const struct input_event *event =
+            &( programEvents[ inAction->firstEvent + i ] );
+        
+        hash ^= event->code;
+        hash *= 16777619U;
+        hash ^= (unsigned int)event->value;
+        hash *= 16777619U;
+        }
+    return hash;
+    }
+
+
+
+char sameCompiledActions( const CompiledAction *inA,
+                          const CompiledAction *inB ) {
+    return inA->numOps == inB->numOps &&
+        inA->numEvents == inB->numEvents &&
+        inA->repeatKind == inB->repeatKind &&
+        memcmp( &( programOps[ inA->firstOp ] ),
+                &( programOps[ inB->firstOp ] ),
+                (size_t)inA->numOps * sizeof( ProgramOp ) ) == 0 &&
+        memcmp( &( programEvents[ inA->firstEvent ] ),
+                &( programEvents[ inB->firstEvent ] ),
+                (size_t)inA->numEvents * sizeof( struct input_event ) ) == 0;
+    }
+
+
+
+/* sends inAction, or nothing if inAction is NULL, waiting at least
+   inComboGapMS between key combos
+   Forgets any combo held down by HOLD in inDevice, and tracks the one
+   inAction holds, if any.
+   If inAction has a SLEEP_ trigger, or has to wait for inComboGapMS,
+   this returns when it gets there, leaving the rest in
+   inDevice->runningAction for continueUinputSequence. */
+void sendUinputSequence( TourBoxDevice *inDevice,
+                         const CompiledAction *inAction,
+                         int inComboGapMS,
+                         int inUinputFile );
+
+/* sends inDevice->runningAction from where it left off, up to its next
+   SLEEP_ trigger (or combo gap) that hasn't ended yet, or to its end,
+   when runningAction becomes NULL */
+void continueUinputSequence( TourBoxDevice *inDevice, int inUinputFile );
+
+/* sends the releases for a combo held down by HOLD on inDevice, if any */
+void releaseHeldCombo( TourBoxDevice *inDevice, int inUinputFile );
+
+
+/* sleeps for a number of milliseconds */
+void msSleep( int inNumMilliseconds );
+
+
+void sendUinputSequence( TourBoxDevice *inDevice,
+                         const CompiledAction *inAction,
+                         int inComboGapMS,
+                         int inUinputFile ) {
+
+    inDevice->heldReleases = NULL;
+    inDevice->numHeldReleases = 0;
+    
+    if( inAction == NULL ) {
+        /* emtpy sequence, send nothing */
+        return;
+        }
+
+    inDevice->runningAction = inAction;
+    inDevice->runningOp = 0;
+    inDevice->runningComboGapMS = inComboGapMS;
+    /* the first sleep is timed from now */
+    inDevice->runningResumeMS = getCurrentTimeMS();
+
+    continueUinputSequence( inDevice, inUinputFile );
+    }
+
+
+
+void continueUinputSequence( TourBoxDevice *inDevice, int inUinputFile ) {
+    const CompiledAction *action = inDevice->runningAction;
+    const ProgramOp *ops = &( programOps[ action->firstOp ] );
+    const struct input_event *events = &( programEvents[ action->firstEvent ] );
+    int o;
+    
+    for( o=inDevice->runningOp; o<action->numOps; o++ ) {
+        const ProgramOp *op = &( ops[o] );
+        
+        switch( op->kind ) {
+            case PROGRAM_EMIT:
+                uinputEmitEvents( inUinputFile, &( events[ op->firstEvent ] ),
+                                  op->numEvents );
+                break;
+            case PROGRAM_SLEEP:
+                inDevice->runningResumeMS += op->value;
+
+                if( inDevice->runningResumeMS > getCurrentTimeMS() ) {
+                    /* what we have so far goes out before the sleep */
+                    flushUinputEvents( inUinputFile );
+
+                    /* pick up after this op once the sleep is over */
+                    inDevice->runningOp = o + 1;
+                    return;
+                    }
+                break;
+            case PROGRAM_COMBO_START:
+                if( inDevice->runningComboGapMS > 0 ) {
+                    /* too soon after the last combo? */
+                    double comboMS =
+                        inDevice->lastComboMS + inDevice->runningComboGapMS;
+
+                    if( comboMS > getCurrentTimeMS() ) {
+                        flushUinputEvents( inUinputFile );
+
+                        /* pick up at this op once the gap is over */
+                        inDevice->runningResumeMS = comboMS;
+                        inDevice->runningOp = o;
+                        paceStatComboWaits++;
+                        return;
+                        }
+                    }
+                break;
+            case PROGRAM_COMBO_END:
+                if( inDevice->runningComboGapMS > 0 ) {
+                    inDevice->lastComboMS = getCurrentTimeMS();
+                    }
+                break;
+            case PROGRAM_HOLD:
+                inDevice->heldReleases = &( events[ op->firstEvent ] );
+                inDevice->numHeldReleases = op->numEvents;
+                break;
+            }
+        }
+    
+    flushUinputEvents( inUinputFile );
+
+    inDevice->runningAction = NULL;
+    }
+
+
+
+void releaseHeldCombo( TourBoxDevice *inDevice, int inUinputFile ) {
+    if( inDevice->heldReleases == NULL ) {
+        return;
+        }
+    uinputEmitEvents( inUinputFile, inDevice->heldReleases,
+                      inDevice->numHeldReleases );
+    flushUinputEvents( inUinputFile );
+
+    inDevice->heldReleases = NULL;
+    inDevice->numHeldReleases = 0;
+    }
+
+
+void msSleep( int inNumMilliseconds ) {
+    struct timespec ts;
+    ts.tv_sec = inNumMilliseconds / 1000;
+    ts.tv_nsec = ( inNumMilliseconds % 1000 ) * 1000000;
+
+    nanosleep( &ts, NULL );
+    }
+
+
+
+
+    
+
+
+
+/* What each of the 256 possible input bytes means, so that decoding a
+   byte in handleTourBoxInput is a single table lookup instead of searching
+   the control code lists. */
+typedef struct ByteDecoding {
+        /* index into tourBoxControlCodes, or -1 if the byte isn't a known
+           control */
+        signed char controlIndex;
+
+        /* index into tourBoxPressControlCodes, or -1 if it isn't a press
+           control */
+        signed char pressIndex;
+
+        /* index into tourBoxTurnWidgets, or -1 if it isn't a turn */
+        signed char turnWidgetIndex;
+
+        /* PRESS or RELEASE, for press controls */
+        unsigned char actionCode;
+    } ByteDecoding;
+
+
+ByteDecoding byteDecodings[ 256 ];
+
+
+/* fills byteDecodings, call once at startup */
+void buildByteDecodings( void );
+
+/* decodes inByte by searching the control code lists, for
+   buildByteDecodings, and for benchmarking against byteDecodings */
+void decodeByteBySearching( unsigned char inByte, ByteDecoding *outDecoding );
+
+
+
+void buildByteDecodings( void ) {
+    int b;
+
+    for( b=0; b<256; b++ ) {
+        decodeByteBySearching( (unsigned char)b, &( byteDecodings[b] ) );
+        }
+    }
+
+
+
+void decodeByteBySearching( unsigned char inByte,
+                            ByteDecoding *outDecoding ) {
+    /* strip out first 6 bits to get control code */
+    unsigned char controlCode = inByte & 0x3F;
+    int i;
+
+    outDecoding->controlIndex = -1;
+    outDecoding->pressIndex = -1;
+    outDecoding->turnWidgetIndex = -1;
+    /* last two bits */
+    outDecoding->actionCode = inByte & 0xC0;
+    
+    /* first, search for match for our whole byte
+       since turn controls map using the whole byte */
+    for( i=0; i<NUM_TOURBOX_CONTROLS; i++ ) {
+        if( tourBoxControlCodes[i] == inByte ) {
+            outDecoding->controlIndex = (signed char)i;
+            break;
+            }
+        }
+    if( outDecoding->controlIndex == -1 ) {
+        /* no mapping for whole byte
+           this is not a turn control
+           check again using only the controlCode portion of the byte */
+        for( i=0; i<NUM_TOURBOX_CONTROLS; i++ ) {
+            if( tourBoxControlCodes[i] == controlCode ) {
+                outDecoding->controlIndex = (signed char)i;
+                break;
+                }
+            }
+        }
+
+    if( outDecoding->controlIndex == -1 ) {
+        return;
+        }
+    
+    for( i=0; i<NUM_TOURBOX_PRESS_CONTROLS; i++ ) {
+        if( tourBoxPressControlCodes[i] == controlCode ) {
+            outDecoding->pressIndex = (signed char)i;
+            return;
+            }
+        }
+    for( i=0; i<NUM_TOURBOX_TURN_WIDGETS; i++ ) {
+        if( tourBoxTurnWidgets[i] == controlCode ) {
+            outDecoding->turnWidgetIndex = (signed char)i;
+            return;
+            }
+        }
+    }
+
+
+
+/* sends inCount repeats of the turn in inByte from inDevice all at
+   once, if the action it's mapped to allows that
+   returns 1 if they were sent, or 0 if they have to be handled one at a
+   time */
+char sendTurnRepeats( TourBoxDevice *inDevice, unsigned char inByte,
+                      int inCount, int inUinputFile );
+
+
+
+char sendTurnRepeats( TourBoxDevice *inDevice, unsigned char inByte,
+                      int inCount, int inUinputFile ) {
+    const ApplicationMapping *m = inDevice->activeMapping;
+    const ByteDecoding *decoding = &( byteDecodings[ inByte ] );
+    const CompiledAction *action;
+    int r;
+    
+    if( m == NULL || decoding->turnWidgetIndex == -1 ||
+        m->paceComboGapMS > 0 || m->paceTurnRate > 0 ) {
+        return 0;
+        }
+    
+    action = m->actions[ inDevice->heldPressControlIndex + 1 ]
+                       [ decoding->controlIndex ];
+
+    if( action == NULL || action->repeatKind == REPEAT_ONE_AT_A_TIME ) {
+        return 0;
+        }
+
+    /* same as sendUinputSequence */
+    inDevice->heldReleases = NULL;
+    inDevice->numHeldReleases = 0;
+    
+    if( action->repeatKind == REPEAT_SCROLL ) {
+        /* one scroll covers all of them */
+        if( action->scrollPerSend != 0 ) {
+            uinputEmit( inUinputFile, EV_REL, REL_WHEEL,
+                        action->scrollPerSend * inCount );
+            uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
+            }
+        }
+    else {
+        /* the events of one send, over and over */
+        for( r=0; r<inCount; r++ ) {
+            uinputEmitEvents( inUinputFile,
+                              &( programEvents[ action->firstEvent ] ),
+                              action->numEvents );
+            }
+        }
+    flushUinputEvents( inUinputFile );
+
+    queueStatBatchedTurns += (unsigned long)inCount;
+    return 1;
+    }
+
+
+
+/* processes input byte from inDevice, applying inActiveMapping and
+   generating key events to uinput
+   If inActiveMapping is NULL, we send no uinput, but we still process
+   inputs to track which buttons are held down. */
+void handleTourBoxInput( unsigned char inByte,
+                         TourBoxDevice *inDevice,
+                         ApplicationMapping *inActiveMapping,
+                         int inUinputFile );
+
+
+/* forgets which buttons are held down on inDevice, and releases any HOLD
+   keys that are still held on their behalf
+   Call when the TourBox goes away, since we'll never see their releases */
+void resetTourBoxInputState( TourBoxDevice *inDevice, int inUinputFile );
+
+
+
+void resetTourBoxInputState( TourBoxDevice *inDevice, int inUinputFile ) {
+    releaseHeldCombo( inDevice, inUinputFile );
+    
+    inDevice->heldPressControlIndex = -1;
+    }
+
+
+void handleTourBoxInput( unsigned char inByte,
+                         TourBoxDevice *inDevice,
+                         ApplicationMapping *inActiveMapping,
+                         int inUinputFile ) {
+    const ByteDecoding *decoding = &( byteDecodings[ inByte ] );
+    unsigned char actionCode = decoding->actionCode;
+    int controlIndex = decoding->controlIndex;
+    int pressIndex = decoding->pressIndex;
+    int turnWidgetIndex = decoding->turnWidgetIndex;
+    
+    if( controlIndex == -1 ) {
+        printf( "Failed to extract known control code "
+                "from TourBox input byte 0x%02X\n", inByte );
+        return;
+        }
+
+    if( pressIndex != -1 ) {
+        if( actionCode == PRESS ) {
+            if( inActiveMapping != NULL ) {
+                /* send event for this press */
+                sendUinputSequence(
+                    inDevice,
+                    inActiveMapping->actions
+                    [ inDevice->heldPressControlIndex + 1 ][ controlIndex ],
+                    inActiveMapping->paceComboGapMS,
+                    inUinputFile );
+                }
+            
+            if( inDevice->heldPressControlIndex == -1 ) {
+                inDevice->heldPressControlIndex = pressIndex;
+                }
+            /* else something else already held, don't track new
+               hold */
+            }
+        else if( actionCode == RELEASE ) {
+            /* we never send events for releases */
+
+            /* UNLESS there's a previous combo still held down */
+
+            releaseHeldCombo( inDevice, inUinputFile );
+            
+            if( inDevice->heldPressControlIndex == pressIndex ) {
+                /* a release of what we have marked as held */
+                inDevice->heldPressControlIndex = -1;
+                }
+            }
+        }
+    else if( turnWidgetIndex != -1 ) {
+        if( inActiveMapping != NULL ) {
+            /* send event for this turn */
+            sendUinputSequence(
+                inDevice,
+                inActiveMapping->actions
+                [ inDevice->heldPressControlIndex + 1 ][ controlIndex ],
+                inActiveMapping->paceComboGapMS,
+                inUinputFile );
+            }
+        }
+    }
+
+
+
+
+
+/* checked by both the main event loop and the executor thread
+   set to 0 through stopInputLoop */
+volatile char inputLoopContinue = 1;
+
+
+/* Generates a test settings file that comprehensively tests
+   every combination of control inputs */
+void generateTestSettingsFile( const char *inOutputFileName );
+
+/* Times title matching with the matcher and with checking names one at
+   a time, for synthetic application names, from 64 names up to 10,000.
+   Clobbers appMappings, so only call it instead of running the driver.
+   With the default sizes, only the 64-name run fits, and the rest are
+   skipped.  For all of them, set MAX_NUM_APPS to 10000 and
+   MATCHER_TABLE_SIZE to 4194304 first. */
+void benchmarkMatcher( void );
+
+/* Times decoding synthetic streams of TourBox input bytes with
+   byteDecodings and with searching the control code lists. */
+void benchmarkByteDecoding( void );
+
+/* Times typing a quoted string to /dev/null, writing each uinput event
+   separately and in batches, and counts the writes. */
+void benchmarkUinputBatching( void );
+
+
+
+/* the window in the foreground, only touched by the focus thread */
+WindowInfo activeWindowInfo;
+
+
+/* file handle for /dev/uinput */
+int uinputFile = -1;
+
+
+
+/* Input queue between the main event loop (the only producer), which
+   reads USB, and the executor thread (the only consumer), which sends
+   key sequences.
+
+   This is a lock-free ring buffer.  inputQueueHead is only advanced by the
+   producer.  inputQueueTail is advanced by the consumer as it pops, but
+   also by the producer when it drops the oldest queued turn, so both
+   sides advance it with a compare-and-swap.  Both indices count up
+   forever and wrap around as unsigned ints. */
+
+#define INPUT_QUEUE_BLOCK        0
+#define INPUT_QUEUE_DROP_OLDEST  1
+#define INPUT_QUEUE_COALESCE     2
+
+/* kinds of queue entries */
+#define INPUT_QUEUE_BYTE    0
+#define INPUT_QUEUE_RESET   1
+
+typedef struct InputQueueEntry {
+        /* INPUT_QUEUE_BYTE for an input byte from the TourBox,
+           or INPUT_QUEUE_RESET when the TourBox was disconnected, telling
+           the consumer to forget what is held down */
+        unsigned char kind;
+
+        /* index into tourBoxDevices of the TourBox it came from */
+        unsigned char device;
+        
+        unsigned char byte;
+        /* how many times in a row this byte arrived, more than 1 if
+           repeats were coalesced */
+        unsigned short count;
+    } InputQueueEntry;
+
+
+InputQueueEntry inputQueue[ INPUT_QUEUE_SIZE ];
+
+volatile unsigned int inputQueueHead = 0;
+volatile unsigned int inputQueueTail = 0;
+
+
+/* only touched by the producer
+   a coalesced turn that is still waiting for room in the queue,
+   or count of 0 if there is none */
+InputQueueEntry inputQueueStaged = { INPUT_QUEUE_BYTE, 0, 0, 0 };
+
+
+/* only touched by the consumer
+   entries (or what's left of their repeats) set aside for each TourBox,
+   indexed the same as tourBoxDevices, while it is still running a key
+   sequence or waiting for paceTurnRate
+   Later entries from the same TourBox are set aside behind them, to keep
+   the order, but entries from other TourBoxes are handled right away.
+   Each is a ring buffer starting at firstWaitingInputs. */
+InputQueueEntry waitingInputs[ MAX_NUM_TOURBOXES ][ MAX_WAITING_INPUTS ];
+
+int firstWaitingInputs[ MAX_NUM_TOURBOXES ];
+int numWaitingInputs[ MAX_NUM_TOURBOXES ];
+
+
+/* only touched by the consumer
+   the next entry, popped while looking for more repeats of a turn, or
+   put back because its TourBox had no room to set it aside, or count of
+   0 if there is none */
+InputQueueEntry inputQueueLookahead = { INPUT_QUEUE_BYTE, 0, 0, 0 };
+
+
+/* the producer writes a byte to this pipe after pushing, and the
+   consumer polls the read end */
+int inputQueueWakePipe[2] = { -1, -1 };
+
+
+/* how long the producer waits between retries when it is blocked */
+#define INPUT_QUEUE_RETRY_MS  1
+
+
+/* how often each overflow policy fired */
+unsigned long queueStatDroppedTurns = 0;
+unsigned long queueStatCoalescedTurns = 0;
+unsigned long queueStatBlocks = 0;
+unsigned int queueStatMaxDepth = 0;
+
+
+/* indexed the same as tourBoxTurnWidgets */
+int turnWidgetQueuePolicies[ NUM_TOURBOX_TURN_WIDGETS ] = {
+    KNOB_TURN_QUEUE_POLICY,
+    SCROLL_TURN_QUEUE_POLICY,
+    DIAL_TURN_QUEUE_POLICY
+    };
+
+
+/* creates the wake pipe
+   returns 1 on success, 0 on failure */
+char initInputQueue( void );
+
+void closeInputQueue( void );
+
+/* producer only
+   returns 1 on success, 0 if queue is full */
+char pushInputQueue( InputQueueEntry inEntry );
+
+/* consumer only
+   returns 1 if an entry was popped, 0 if queue is empty */
+char popInputQueue( InputQueueEntry *outEntry );
+
+/* producer only
+   drops the oldest queued entry if it is a turn of inTurnWidgetIndex
+   from TourBox inDeviceIndex
+   returns 1 if there is room in the queue now, 0 if the oldest queued
+   entry is anything else */
+char dropOldestQueuedTurn( unsigned char inDeviceIndex,
+                           int inTurnWidgetIndex );
+
+/* producer only
+   tries to push inputQueueStaged without blocking
+   returns 1 if nothing is left staged, 0 if queue is still full */
+char flushStagedInput( void );
+
+/* producer only
+   queues one input byte from a TourBox, applying the overflow policy for
+   its control if the queue is full */
+void queueTourBoxInput( unsigned char inDeviceIndex, unsigned char inByte );
+
+/* producer only
+   queues a reset for a TourBox after everything queued so far, blocking
+   if needed */
+void queueTourBoxReset( unsigned char inDeviceIndex );
+
+/* producer only
+   waits INPUT_QUEUE_RETRY_MS for room in the queue while blocked
+   The event loop can't handle anything while the producer is blocked, so
+   this watches for signals itself, and handles them.
+   returns 1 to keep trying, or 0 if the driver is exiting */
+char waitForQueueRoom( void );
+
+/* wakes the consumer if it is waiting in waitForInputQueue */
+void wakeInputConsumer( void );
+
+/* consumer only
+   waits up to inTimeoutMS for the producer to wake us, or forever if
+   inTimeoutMS is -1
+   returns 1 if woken, 0 on timeout */
+char waitForInputQueue( int inTimeoutMS );
+
+/* consumer only
+   handles the entries set aside for each TourBox that can go now, and
+   then everything in the queue, setting aside entries for TourBoxes that
+   are still running a key sequence or waiting for paceTurnRate
+   returns 1 if any input was handled */
+char drainInputQueue( void );
+
+/* consumer only
+   handles as much of ioEntry as its TourBox can take now, counting down
+   ioEntry->count
+   returns 1 if any of it was handled */
+char handleQueuedInput( InputQueueEntry *ioEntry );
+
+/* consumer only
+   handles the entries set aside for a TourBox, in order, until one has to
+   wait
+   returns 1 if any input was handled */
+char handleWaitingInputs( int inDeviceIndex );
+
+/* consumer only
+   sets inEntry aside behind the other entries waiting for its TourBox,
+   merging it into the last one if it's another repeat of the same turn
+   returns 1 on success, or 0 if that TourBox has no room */
+char addWaitingInput( const InputQueueEntry *inEntry );
+
+/* consumer only
+   pops the next entry, from inputQueueLookahead if it has one
+   returns 1 if an entry was popped, 0 if queue is empty */
+char popNextInput( InputQueueEntry *outEntry );
+
+/* consumer only
+   if ioEntry is a turn, merges the repeats of it that were queued right
+   behind it into it */
+void gatherTurnRepeats( InputQueueEntry *ioEntry );
+
+/* consumer only
+   continues the key sequences whose sleeps have ended */
+void resumeUinputSequences( void );
+
+/* consumer only
+   returns how many milliseconds until the next sleeping key sequence
+   should continue, or turn waiting for paceTurnRate can go, 0 if one can
+   go now, or -1 if nothing is waiting */
+int getMSUntilSequenceResumes( void );
+
+/* consumer only
+   checks whether input byte inByte from inDevice can be handled now
+   under the paceTurnRate of its active mapping, using up a token if it's
+   a turn that sends a key sequence
+   returns 1 if it can, or 0 if it has to wait until inDevice->turnWaitMS */
+char takeTurnToken( TourBoxDevice *inDevice, unsigned char inByte );
+
+/* stops both threads, from either one */
+void stopInputLoop( void );
+
+
+
+char initInputQueue( void ) {
+    int i;
+    
+    if( pipe( inputQueueWakePipe ) != 0 ) {
+        return 0;
+        }
+    for( i=0; i<2; i++ ) {
+        fcntl( inputQueueWakePipe[i], F_SETFL,
+               fcntl( inputQueueWakePipe[i], F_GETFL ) | O_NONBLOCK );
+        }
+    return 1;
+    }
+
+
+
+void closeInputQueue( void ) {
+    close( inputQueueWakePipe[0] );
+    close( inputQueueWakePipe[1] );
+    }
+
+
+
+char pushInputQueue( InputQueueEntry inEntry ) {
+    unsigned int head = inputQueueHead;
+    unsigned int depth = head - inputQueueTail;
+
+    if( depth >= INPUT_QUEUE_SIZE ) {
+        return 0;
+        }
+
+    inputQueue[ head & ( INPUT_QUEUE_SIZE - 1 ) ] = inEntry;
+
+    /* entry must be visible before head moves past it */
+    __sync_synchronize();
+    
+    inputQueueHead = head + 1;
+
+    if( depth + 1 > queueStatMaxDepth ) {
+        queueStatMaxDepth = depth + 1;
+        }
+    return 1;
+    }
+
+
+
+char popInputQueue( InputQueueEntry *outEntry ) {
+    while( 1 ) {
+        unsigned int tail = inputQueueTail;
+
+        if( tail == inputQueueHead ) {
+            return 0;
+            }
+        
+        __sync_synchronize();
+        
+        *outEntry = inputQueue[ tail & ( INPUT_QUEUE_SIZE - 1 ) ];
+
+        __sync_synchronize();
+
+        if( __sync_bool_compare_and_swap( &inputQueueTail, tail, tail + 1 ) ) {
+            return 1;
+            }
+        /* else the producer dropped this entry while we were reading it,
+           and may have overwritten it, so try again with the next one */
+        }
+    }
+
+
+
+char dropOldestQueuedTurn( unsigned char inDeviceIndex,
+                           int inTurnWidgetIndex ) {
+    unsigned int tail = inputQueueTail;
+    InputQueueEntry oldest;
+
+    if( inputQueueHead - tail < INPUT_QUEUE_SIZE ) {
+        /* consumer made room in the meantime */
+        return 1;
+        }
+    
+    oldest = inputQueue[ tail & ( INPUT_QUEUE_SIZE - 1 ) ];
+
+    if( oldest.kind != INPUT_QUEUE_BYTE ||
+        oldest.device != inDeviceIndex ||
+        controlToTurnWidgetIndex( oldest.byte ) != inTurnWidgetIndex ) {
+        /* never drop presses, releases, or resets, or turns that follow
+           some other widget's policy */
+        return 0;
+        }
+
+    if( __sync_bool_compare_and_swap( &inputQueueTail, tail, tail + 1 ) ) {
+        queueStatDroppedTurns += oldest.count;
+        }
+    /* else the consumer popped it first, which made room too */
+    
+    return 1;
+    }
+
+
+
+char flushStagedInput( void ) {
+    if( inputQueueStaged.count == 0 ) {
+        return 1;
+        }
+    if( ! pushInputQueue( inputQueueStaged ) ) {
+        return 0;
+        }
+    inputQueueStaged.count = 0;
+    wakeInputConsumer();
+    return 1;
+    }
+
+
+
+void queueTourBoxInput( unsigned char inDeviceIndex, unsigned char inByte ) {
+    InputQueueEntry entry;
+    int policy = INPUT_QUEUE_BLOCK;
+    int turnWidgetIndex = controlToTurnWidgetIndex( inByte );
+
+    if( turnWidgetIndex != -1 ) {
+        policy = turnWidgetQueuePolicies[ turnWidgetIndex ];
+        }
+    
+    entry.kind = INPUT_QUEUE_BYTE;
+    entry.device = inDeviceIndex;
+    entry.byte = inByte;
+    entry.count = 1;
+    
+    if( inputQueueStaged.count > 0 ) {
+        if( inputQueueStaged.byte == inByte &&
+            inputQueueStaged.device == inDeviceIndex &&
+            inputQueueStaged.count < 0xFFFF ) {
+            /* another repeat of the turn that is waiting for room */
+            inputQueueStaged.count++;
+            queueStatCoalescedTurns++;
+            return;
+            }
+        
+        /* something different, staged turn must go first to keep order */
+        if( ! flushStagedInput() ) {
+            queueStatBlocks++;
+            
+            while( ! flushStagedInput() ) {
+                if( ! waitForQueueRoom() ) {
+                    /* exiting, so nothing more gets handled anyway */
+                    return;
+                    }
+                }
+            }
+        }
+
+    if( pushInputQueue( entry ) ) {
+        wakeInputConsumer();
+        return;
+        }
+
+    /* queue is full */
+    
+    if( policy == INPUT_QUEUE_DROP_OLDEST ) {
+        if( dropOldestQueuedTurn( inDeviceIndex, turnWidgetIndex ) &&
+            pushInputQueue( entry ) ) {
+            wakeInputConsumer();
+            return;
+            }
+        }
+    else if( policy == INPUT_QUEUE_COALESCE ) {
+        /* hold it back, merging any repeats, until there's room */
+        inputQueueStaged = entry;
+        return;
+        }
+    
+    queueStatBlocks++;
+    
+    while( ! pushInputQueue( entry ) ) {
+        if( ! waitForQueueRoom() ) {
+            return;
+            }
+        }
+    wakeInputConsumer();
+    }
+
+
+
+void queueTourBoxReset( unsigned char inDeviceIndex ) {
+    InputQueueEntry entry;
+
+    entry.kind = INPUT_QUEUE_RESET;
+    entry.device = inDeviceIndex;
+    entry.byte = 0;
+    entry.count = 1;
+
+    /* anything still staged came before the reset */
+    while( ! flushStagedInput() ) {
+        if( ! waitForQueueRoom() ) {
+            return;
+            }
+        }
+    while( ! pushInputQueue( entry ) ) {
+        if( ! waitForQueueRoom() ) {
+            return;
+            }
+        }
+    wakeInputConsumer();
+    }
+
+
+
+void wakeInputConsumer( void ) {
+    unsigned char wakeByte = 1;
+
+    /* if the pipe is full, the consumer has plenty of wake ups pending
+       already, so ignore failure here */
+    if( write( inputQueueWakePipe[1], &wakeByte, 1 ) != 1 ) {
+        }
+    }
+
+
+
+char waitForInputQueue( int inTimeoutMS ) {
+    struct pollfd wakeFD;
+    unsigned char wakeBytes[ 64 ];
+    
+    wakeFD.fd = inputQueueWakePipe[0];
+    wakeFD.events = POLLIN;
+    wakeFD.revents = 0;
+
+    if( poll( &wakeFD, 1, inTimeoutMS ) <= 0 ) {
+        /* timeout, or interrupted by a signal */
+        return 0;
+        }
+
+    /* clear out all pending wake ups, we handle everything queued
+       from here */
+    while( read( inputQueueWakePipe[0], wakeBytes, sizeof( wakeBytes ) )
+           > 0 ) {
+        }
+    return 1;
+    }
+
+
+
+char drainInputQueue( void ) {
+    InputQueueEntry entry;
+    char gotInput = 0;
+    int d;
+
+    /* what was set aside came before anything still in the queue */
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( handleWaitingInputs( d ) ) {
+            gotInput = 1;
+            }
+        }
+    
+    while( popNextInput( &entry ) ) {
+        if( numWaitingInputs[ entry.device ] > 0 ) {
+            /* it goes behind what its TourBox already has waiting */
+            if( ! addWaitingInput( &entry ) ) {
+                /* no room, so put it back, and leave the rest in the
+                   queue until there is */
+                inputQueueLookahead = entry;
+                break;
+                }
+            continue;
+            }
+        
+        gatherTurnRepeats( &entry );
+
+        if( handleQueuedInput( &entry ) ) {
+            gotInput = 1;
+            }
+
+        if( entry.count > 0 ) {
+            /* the rest has to wait, but there's always room for it
+               behind nothing */
+            addWaitingInput( &entry );
+            }
+        }
+    return gotInput;
+    }
+
+
+
+char handleQueuedInput( InputQueueEntry *ioEntry ) {
+    TourBoxDevice *device = &( tourBoxDevices[ ioEntry->device ] );
+    char gotInput = 0;
+    
+    if( device->runningAction != NULL ) {
+        /* wait for its sequence to finish */
+        return 0;
+        }
+
+    if( ioEntry->kind == INPUT_QUEUE_RESET ) {
+        resetTourBoxInputState( device, uinputFile );
+        ioEntry->count = 0;
+        return 1;
+        }
+    
+    while( ioEntry->count > 0 && device->runningAction == NULL &&
+           takeTurnToken( device, ioEntry->byte ) ) {
+
+        gotInput = 1;
+        
+        if( ioEntry->count > 1 &&
+            sendTurnRepeats( device, ioEntry->byte, ioEntry->count,
+                             uinputFile ) ) {
+            ioEntry->count = 0;
+            break;
+            }
+        
+        ioEntry->count--;
+        
+        /* trigger uniput commands based on active mapping
+           even if mapping is NULL, call this to track button
+           presses and releases */
+        handleTourBoxInput( ioEntry->byte, device, device->activeMapping,
+                            uinputFile );
+        }
+    return gotInput;
+    }
+
+
+
+char handleWaitingInputs( int inDeviceIndex ) {
+    char gotInput = 0;
+    
+    while( numWaitingInputs[ inDeviceIndex ] > 0 ) {
+        InputQueueEntry *entry =
+            &( waitingInputs[ inDeviceIndex ]
+                            [ firstWaitingInputs[ inDeviceIndex ] ] );
+
+        if( handleQueuedInput( entry ) ) {
+            gotInput = 1;
+            }
+        
+        if( entry->count > 0 ) {
+            /* still has to wait */
+            break;
+            }
+        
+        firstWaitingInputs[ inDeviceIndex ] =
+            ( firstWaitingInputs[ inDeviceIndex ] + 1 ) % MAX_WAITING_INPUTS;
+        numWaitingInputs[ inDeviceIndex ]--;
+        }
+    return gotInput;
+    }
+
+
+
+char addWaitingInput( const InputQueueEntry *inEntry ) {
+    int d = inEntry->device;
+    InputQueueEntry *last;
+    
+    if( numWaitingInputs[d] > 0 ) {
+        last = &( waitingInputs[d][ ( firstWaitingInputs[d] +
+                                      numWaitingInputs[d] - 1 )
+                                    % MAX_WAITING_INPUTS ] );
+        
+        if( inEntry->kind == INPUT_QUEUE_BYTE &&
+            last->kind == INPUT_QUEUE_BYTE &&
+            last->byte == inEntry->byte &&
+            byteDecodings[ inEntry->byte ].turnWidgetIndex != -1 &&
+            last->count <= 0xFFFF - inEntry->count ) {
+            /* another repeat of the same turn */
+            last->count = (unsigned short)( last->count + inEntry->count );
+            return 1;
+            }
+        }
+
+    if( numWaitingInputs[d] >= MAX_WAITING_INPUTS ) {
+        return 0;
+        }
+
+    waitingInputs[d][ ( firstWaitingInputs[d] + numWaitingInputs[d] )
+                      % MAX_WAITING_INPUTS ] = *inEntry;
+    numWaitingInputs[d]++;
+    return 1;
+    }
+
+
+
+char popNextInput( InputQueueEntry *outEntry ) {
+    if( inputQueueLookahead.count > 0 ) {
+        *outEntry = inputQueueLookahead;
+        inputQueueLookahead.count = 0;
+        return 1;
+        }
+    return popInputQueue( outEntry );
+    }
+
+
+
+void gatherTurnRepeats( InputQueueEntry *ioEntry ) {
+    InputQueueEntry *entry = ioEntry;
+    InputQueueEntry *next = &inputQueueLookahead;
+
+    if( entry->kind != INPUT_QUEUE_BYTE ||
+        byteDecodings[ entry->byte ].turnWidgetIndex == -1 ) {
+        return;
+        }
+    
+    while( entry->count < 0xFFFF ) {
+        unsigned short numMerged;
+        
+        if( next->count == 0 && ! popInputQueue( next ) ) {
+            return;
+            }
+        if( next->kind != INPUT_QUEUE_BYTE ||
+            next->device != entry->device ||
+            next->byte != entry->byte ) {
+            /* something else, or a turn the other way, has to wait its
+               turn */
+            return;
+            }
+
+        numMerged = next->count;
+        if( numMerged > 0xFFFF - entry->count ) {
+            numMerged = (unsigned short)( 0xFFFF - entry->count );
+            }
+        entry->count = (unsigned short)( entry->count + numMerged );
+        next->count = (unsigned short)( next->count - numMerged );
+        }
+    }
+
+
+
+char takeTurnToken( TourBoxDevice *inDevice, unsigned char inByte ) {
+    const ApplicationMapping *m = inDevice->activeMapping;
+    double currentMS;
+
+    if( m == NULL || m->paceTurnRate == 0 ||
+        byteDecodings[ inByte ].turnWidgetIndex == -1 ||
+        m->actions[ inDevice->heldPressControlIndex + 1 ]
+                  [ byteDecodings[ inByte ].controlIndex ] == NULL ) {
+        /* nothing to wait for, even if a turn was waiting under a
+           mapping that is no longer active */
+        inDevice->turnWaiting = 0;
+        return 1;
+        }
+
+    currentMS = getCurrentTimeMS();
+
+    inDevice->turnTokens +=
+        ( currentMS - inDevice->turnTokensMS ) * m->paceTurnRate / 1000.0;
+    inDevice->turnTokensMS = currentMS;
+    
+    if( inDevice->turnTokens > m->paceTurnBurst ) {
+        inDevice->turnTokens = m->paceTurnBurst;
+        }
+
+    if( inDevice->turnTokens >= 1 ) {
+        inDevice->turnTokens -= 1;
+        inDevice->turnWaiting = 0;
+        return 1;
+        }
+
+    if( ! inDevice->turnWaiting ) {
+        paceStatTurnWaits++;
+        }
+    inDevice->turnWaiting = 1;
+    inDevice->turnWaitMS =
+        currentMS + ( 1 - inDevice->turnTokens ) * 1000.0 / m->paceTurnRate;
+    return 0;
+    }
+
+
+
+void resumeUinputSequences( void ) {
+    double currentMS = getCurrentTimeMS();
+    int d;
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        
+        if( device->runningAction != NULL &&
+            device->runningResumeMS <= currentMS ) {
+            continueUinputSequence( device, uinputFile );
+            }
+        }
+    }
+
+
+
+int getMSUntilSequenceResumes( void ) {
+    double currentMS = getCurrentTimeMS();
+    double soonestMS = -1;
+    int d;
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        
+        if( device->runningAction != NULL &&
+            ( soonestMS == -1 || device->runningResumeMS < soonestMS ) ) {
+            soonestMS = device->runningResumeMS;
+            }
+        if( device->turnWaiting &&
+            ( soonestMS == -1 || device->turnWaitMS < soonestMS ) ) {
+            soonestMS = device->turnWaitMS;
+            }
+        }
+
+    if( soonestMS == -1 ) {
+        return -1;
+        }
+    if( soonestMS <= currentMS ) {
+        return 0;
+        }
+    /* round up, so we never wake up before it's time */
+    return (int)( soonestMS - currentMS ) + 1;
+    }
+
+
+
+void stopInputLoop( void ) {
+    inputLoopContinue = 0;
+    wakeInputConsumer();
+    }
+
+
+
+/* Input timing measurements, printed at shutdown.
+
+   A "gap" is a stretch of time where no USB read is queued with the
+   TourBox, so anything the user does during a gap waits in the device.
+
+   A read that completes almost immediately after being queued found its
+   input already waiting in the device, so its events count as late. */
+
+/* reads that complete faster than this after being queued are late */
+#define LATE_INPUT_READ_MS  1.0
+
+unsigned long inputStatReads = 0;
+unsigned long inputStatEvents = 0;
+unsigned long inputStatLateEvents = 0;
+unsigned long inputStatErrors = 0;
+double inputStatGapTotalMS = 0;
+double inputStatGapMaxMS = 0;
+
+/* how many reads carried 1, 2, 3, ... events
+   the last bin counts every read with that many events or more */
+#define NUM_BURST_SIZE_BINS  8
+
+unsigned long inputStatBurstSizes[ NUM_BURST_SIZE_BINS ];
+
+/* how many reads are queued with the TourBox right now */
+int inputReadsPending = 0;
+
+/* when the current gap started, if inputReadsPending is 0 */
+double inputGapStartMS = 0;
+
+
+/* call when a read is queued, or about to start blocking */
+void noteInputReadQueued( void );
+
+/* call when a read completes, successfully or not */
+void noteInputReadDone( void );
+
+/* call for each read that returned data
+   inQueuedMS is when the read was queued */
+void noteInputReadData( double inQueuedMS, int inNumBytes );
+
+void printInputStats( void );
+
+
+/* walks every byte of a USB read into the input queue, in order
+   The TourBox sends one byte per event, but the device or host controller
+   can pack a burst of events from a fast spin into a single read. */
+void decodeTourBoxInput( TourBoxDevice *inDevice,
+                         const unsigned char *inBytes, int inNumBytes );
+
+
+
+void noteInputReadQueued( void ) {
+    if( inputReadsPending == 0 ) {
+        double gapMS = getCurrentTimeMS() - inputGapStartMS;
+
+        inputStatGapTotalMS += gapMS;
+        if( gapMS > inputStatGapMaxMS ) {
+            inputStatGapMaxMS = gapMS;
+            }
+        }
+    inputReadsPending++;
+    }
+
+
+
+void noteInputReadDone( void ) {
+    inputReadsPending--;
+    
+    if( inputReadsPending == 0 ) {
+        inputGapStartMS = getCurrentTimeMS();
+        }
+    }
+
+
+
+void noteInputReadData( double inQueuedMS, int inNumBytes ) {
+    int bin = inNumBytes - 1;
+    
+    inputStatReads++;
+    inputStatEvents += (unsigned long)inNumBytes;
+
+    if( bin >= NUM_BURST_SIZE_BINS ) {
+        bin = NUM_BURST_SIZE_BINS - 1;
+        }
+    inputStatBurstSizes[ bin ]++;
+
+    if( getCurrentTimeMS() - inQueuedMS < LATE_INPUT_READ_MS ) {
+        inputStatLateEvents += (unsigned long)inNumBytes;
+        }
+    }
+
+
+
+void printInputStats( void ) {
+    int b;
+    
+    printf( "\nInput stats (%s transport):\n"
+            "    %lu events in %lu reads, %lu read errors\n"
+            "    %lu events were already waiting when a read was queued\n"
+            "    no read queued for %.1f ms total, longest gap %.1f ms\n",
+            transport->name,
+            inputStatEvents, inputStatReads, inputStatErrors,
+            inputStatLateEvents,
+            inputStatGapTotalMS, inputStatGapMaxMS );
+
+    printf( "    events per read:" );
+    for( b=0; b<NUM_BURST_SIZE_BINS; b++ ) {
+        printf( "  %d%s:%lu", b + 1,
+                ( b == NUM_BURST_SIZE_BINS - 1 ) ? "+" : "",
+                inputStatBurstSizes[b] );
+        }
+    printf( "\n" );
+
+    printf( "    input queue: deepest %u of %d, "
+            "%lu turns dropped, %lu turns coalesced, "
+            "%lu times blocked\n",
+            queueStatMaxDepth, INPUT_QUEUE_SIZE,
+            queueStatDroppedTurns, queueStatCoalescedTurns,
+            queueStatBlocks );
+
+    printf( "    %lu turns sent in batches with their repeats\n",
+            queueStatBatchedTurns );
+
+    if( paceStatComboWaits > 0 || paceStatTurnWaits > 0 ) {
+        printf( "    pacing: held back %lu key combos and %lu turns\n",
+                paceStatComboWaits, paceStatTurnWaits );
+        }
+
+    printf( "    setup messages: %lu sent, "
+            "%lu skipped because haptics were unchanged\n",
+            setupStatSent, setupStatSkipped );
+
+    if( setupStatDone > 0 ) {
+        printf( "    setup message send time: average %.2f ms, "
+                "longest %.2f ms\n",
+                setupStatTotalMS / (double)setupStatDone, setupStatMaxMS );
+        }
+    if( handshakeStatDone > 0 ) {
+        printf( "    connection handshake time: average %.2f ms, "
+                "longest %.2f ms\n",
+                handshakeStatTotalMS / (double)handshakeStatDone,
+                handshakeStatMaxMS );
+        }
+
+    printMemoryFootprint();
+    }
+
+
+
+void decodeTourBoxInput( TourBoxDevice *inDevice,
+                         const unsigned char *inBytes, int inNumBytes ) {
+    int i;
+    
+    for( i=0; i<inNumBytes; i++ ) {
+        queueTourBoxInput( inDevice->index, inBytes[i] );
+        }
+    }
+
+
+
+/* Executor thread.
+   Pops input from the queue and sends key sequences for it, so a long
+   sequence (or a SLEEP_ trigger) never holds up the main event loop.
+   A sequence that reaches a SLEEP_ trigger is set aside until the sleep
+   ends, along with any later input from its TourBox (see waitingInputs),
+   so meanwhile the executor can still handle other TourBoxes, and stop
+   right away when the driver exits. */
+
+pthread_t executorThread;
+
+
+/* returns 1 on success, 0 on failure */
+char startExecutor( void );
+
+/* waits for the executor thread to end, after stopInputLoop */
+void stopExecutor( void );
+
+void *runExecutor( void *inUnused );
+
+
+
+void *runExecutor( void *inUnused ) {
+    while( inputLoopContinue ) {
+        waitForInputQueue( getMSUntilSequenceResumes() );
+
+        resumeUinputSequences();
+        
+        /* send uinput commands based on active mapping */
+        drainInputQueue();
+        }
+
+    (void)inUnused;
+    return NULL;
+    }
+
+
+
+char startExecutor( void ) {
+    if( pthread_create( &executorThread, NULL, runExecutor, NULL ) != 0 ) {
+        printf( "Failed to start executor thread\n" );
+        return 0;
+        }
+    return 1;
+    }
+
+
+
+void stopExecutor( void ) {
+    pthread_join( executorThread, NULL );
+    }
+
+
+
+/* Main event loop.
+   The main thread sleeps in epoll_wait until something actually happens:
+   activity on one of libusb's file descriptors, a signal arriving through
+   our signalfd, a timerfd firing for scheduled work, or the focus thread
+   switching mappings.  USB input is decoded and pushed into the input queue
+   from here. */
+
+#define MAX_EVENT_LOOP_FDS  32
+
+/* called with the fd that has activity, and the epoll events for it */
+typedef void (*EventLoopHandler)( int inFD, unsigned int inEvents );
+
+typedef struct EventLoopWatch {
+        int fd;
+        EventLoopHandler handler;
+    } EventLoopWatch;
+
+
+EventLoopWatch eventLoopWatches[ MAX_EVENT_LOOP_FDS ];
+
+int numEventLoopWatches = 0;
+
+int eventLoopFD = -1;
+
+int signalFD = -1;
+
+int reconnectTimerFD = -1;
+
+
+
+/* creates the epoll set, and watches signals and the reconnect timer
+   Blocks SIGINT, SIGTERM, and SIGHUP for this thread and any threads
+   started after, so they only arrive through our signalfd.
+   returns 1 on success, 0 on failure */
+char initEventLoop( void );
+
+void closeEventLoop( void );
+
+/* runs until stopInputLoop is called */
+void runEventLoop( void );
+
+/* returns 1 on success, 0 on failure */
+char watchEventLoopFD( int inFD, unsigned int inEvents,
+                       EventLoopHandler inHandler );
+
+void unwatchEventLoopFD( int inFD );
+
+
+/* creates a timerfd, watched by the event loop
+   returns the fd, or -1 on failure */
+int createEventLoopTimer( EventLoopHandler inHandler );
+
+/* arms a timer to first fire after inDelayMS and then every inIntervalMS
+   (or only once if inIntervalMS is 0)
+   inDelayMS of 0 disarms the timer */
+void setEventLoopTimer( int inTimerFD, int inDelayMS, int inIntervalMS );
+
+/* call from a timer's handler to acknowledge its expirations */
+void clearEventLoopTimer( int inTimerFD );
+
+
+void handleSignalFD( int inFD, unsigned int inEvents );
+
+void handleReconnectTimer( int inFD, unsigned int inEvents );
+
+
+char watchEventLoopFD( int inFD, unsigned int inEvents,
+                       EventLoopHandler inHandler ) {
+    struct epoll_event event;
+    
+    if( numEventLoopWatches >= MAX_EVENT_LOOP_FDS ) {
+        printf( "Too many file descriptors for event loop\n" );
+        return 0;
+        }
+    
+    memset( &event, 0, sizeof( event ) );
+    event.events = inEvents;
+    event.data.fd = inFD;
+
+    if( epoll_ctl( eventLoopFD, EPOLL_CTL_ADD, inFD, &event ) != 0 ) {
+        return 0;
+        }
+
+    eventLoopWatches[ numEventLoopWatches ].fd = inFD;
+    eventLoopWatches[ numEventLoopWatches ].handler = inHandler;
+    numEventLoopWatches++;
+    
+    return 1;
+    }
+
+
+
+void unwatchEventLoopFD( int inFD ) {
+    int i;
+    struct epoll_event event;
+
+    /* older kernels want a non-NULL event, even for EPOLL_CTL_DEL */
+    memset( &event, 0, sizeof( event ) );
+    epoll_ctl( eventLoopFD, EPOLL_CTL_DEL, inFD, &event );
+    
+    for( i=0; i<numEventLoopWatches; i++ ) {
+        if( eventLoopWatches[i].fd == inFD ) {
+            /* fill hole with last one */
+            eventLoopWatches[i] = eventLoopWatches[ numEventLoopWatches - 1 ];
+            numEventLoopWatches--;
+            return;
+            }
+        }
+    }
+
+
+
+int createEventLoopTimer( EventLoopHandler inHandler ) {
+    int timerFD = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+
+    if( timerFD == -1 ) {
+        return -1;
+        }
+    if( ! watchEventLoopFD( timerFD, EPOLLIN, inHandler ) ) {
+        close( timerFD );
+        return -1;
+        }
+    return timerFD;
+    }
+
+
+
+void setEventLoopTimer( int inTimerFD, int inDelayMS, int inIntervalMS ) {
+    struct itimerspec spec;
+
+    spec.it_value.tv_sec = inDelayMS / 1000;
+    spec.it_value.tv_nsec = ( inDelayMS % 1000 ) * 1000000;
+    spec.it_interval.tv_sec = inIntervalMS / 1000;
+    spec.it_interval.tv_nsec = ( inIntervalMS % 1000 ) * 1000000;
+
+    timerfd_settime( inTimerFD, 0, &spec, NULL );
+    }
+
+
+
+void clearEventLoopTimer( int inTimerFD ) {
+    uint64_t numExpirations;
+
+    if( read( inTimerFD, &numExpirations, sizeof( numExpirations ) ) < 0 ) {
+        /* nothing to clear */
+        }
+    }
+
+
+
+void handleSignalFD( int inFD, unsigned int inEvents ) {
+    struct signalfd_siginfo info;
+
+    (void)inEvents;
+    
+    while( read( inFD, &info, sizeof( info ) ) == sizeof( info ) ) {
+        printf( "\nGot signal (%u), exiting cleanly\n\n", info.ssi_signo );
+        stopInputLoop();
+        }
+    }
+
+
+
+char waitForQueueRoom( void ) {
+    struct pollfd signalPoll;
+
+    if( ! inputLoopContinue ) {
+        return 0;
+        }
+    
+    if( signalFD == -1 ) {
+        msSleep( INPUT_QUEUE_RETRY_MS );
+        return inputLoopContinue;
+        }
+    
+    signalPoll.fd = signalFD;
+    signalPoll.events = POLLIN;
+    signalPoll.revents = 0;
+
+    /* sleeps, unless a signal comes in first */
+    if( poll( &signalPoll, 1, INPUT_QUEUE_RETRY_MS ) > 0 ) {
+        handleSignalFD( signalFD, EPOLLIN );
+        }
+    return inputLoopContinue;
+    }
+
+
+
+
+char initEventLoop( void ) {
+    sigset_t signals;
+    
+    eventLoopFD = epoll_create( MAX_EVENT_LOOP_FDS );
+
+    if( eventLoopFD == -1 ) {
+        printf( "Failed to create epoll set\n" );
+        return 0;
+        }
+
+    
+    /* Ctrl-C, kill, or closing our terminal all exit cleanly */
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    sigaddset( &signals, SIGHUP );
+
+    pthread_sigmask( SIG_BLOCK, &signals, NULL );
+
+    signalFD = signalfd( -1, &signals, 0 );
+
+    if( signalFD == -1 ||
+        fcntl( signalFD, F_SETFL, O_NONBLOCK ) != 0 ||
+        ! watchEventLoopFD( signalFD, EPOLLIN, handleSignalFD ) ) {
+        printf( "Failed to set up signalfd\n" );
+        return 0;
+        }
+
+
+    reconnectTimerFD = createEventLoopTimer( handleReconnectTimer );
+
+    if( reconnectTimerFD == -1 ) {
+        printf( "Failed to create reconnect timer\n" );
+        return 0;
+        }
+    
+    return 1;
+    }
+
+
+
+void closeEventLoop( void ) {
+    close( reconnectTimerFD );
+    close( signalFD );
+    close( eventLoopFD );
+    }
+
+
+
+void runEventLoop( void ) {
+    struct epoll_event events[ MAX_EVENT_LOOP_FDS ];
+    int numEvents;
+    int e;
+    int w;
+    
+    while( inputLoopContinue ) {
+        /* sleep until something happens */
+        int timeoutMS = -1;
+        
+        if( ! flushStagedInput() ) {
+            /* a coalesced turn is still waiting for room in the queue */
+            timeoutMS = INPUT_QUEUE_RETRY_MS;
+            }
+        
+        numEvents = epoll_wait( eventLoopFD, events, MAX_EVENT_LOOP_FDS,
+                                timeoutMS );
+
+        if( numEvents < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+                }
+            printf( "Error waiting for events\n" );
+            stopInputLoop();
+            break;
+            }
+        
+        for( e=0; e<numEvents; e++ ) {
+            /* look up handler now, since an earlier handler in this batch
+               may have stopped watching this fd */
+            for( w=0; w<numEventLoopWatches; w++ ) {
+                if( eventLoopWatches[w].fd == events[e].data.fd ) {
+                    eventLoopWatches[w].handler( events[e].data.fd,
+                                                 events[e].events );
+                    break;
+                    }
+                }
+            }
+        }
+    }
+
+
+
+/* Focus tracking.
+   A focus thread finds out which window is in the foreground from a focus
+   source:  X events on its own connection to the X server, polling xprop,
+   or lines that some other program writes to a FIFO, like a compositor
+   hook on Wayland, or a test script.  Any of them can block for a while,
+   so none of it happens on the main event loop, and window switches still
+   get noticed while TourBox input is streaming in.  If the X server goes
+   away, or the picked source can't be set up, the focus thread falls back
+   to polling xprop.
+
+   When the foreground window belongs to a different application, the
+   focus thread publishes each TourBox's new mapping, which the executor
+   thread uses for the very next input it handles, and then wakes the
+   main event loop to send the new setup messages. */
+
+pthread_t focusThread;
+
+char focusThreadStarted = 0;
+
+volatile char focusThreadContinue = 1;
+
+/* the main thread writes a byte to this pipe to wake the focus thread,
+   either to stop it, or to match the last window name again */
+int focusThreadWakePipe[2] = { -1, -1 };
+
+/* the focus thread writes a byte to this pipe after publishing new
+   mappings, and the main event loop watches the read end */
+int focusSwitchPipe[2] = { -1, -1 };
+
+/* only touched by the focus thread */
+char activeWindowKnown = 0;
+
+/* the title that switchActiveWindow last matched, so title updates that
+   don't actually change it (like an application setting both WM_NAME
+   and _NET_WM_NAME) are skipped
+   Only touched by the focus thread. */
+char lastMatchedTitle[ sizeof( activeWindowInfo.title ) ] = "";
+
+
+typedef struct FocusSource {
+        /* as given on a FOCUS line in the settings file */
+        const char *name;
+
+        /* for messages, like "Getting window switches from the X server" */
+        const char *description;
+        
+        /* called on the main thread before the focus thread starts
+           returns 1 on success, 0 if this source can't be used */
+        char (*init)( void );
+
+        /* runs on the focus thread, switching to each window that comes to
+           the front, until the focus thread is stopped (returns 1), or the
+           source stops working (returns 0) */
+        char (*run)( void );
+        
+    } FocusSource;
+
+
+/* picked with a FOCUS line in the settings file */
+FocusSource *focusSource = NULL;
+
+
+/* focus stats, only touched by the focus thread until it is stopped */
+unsigned long focusStatLookups = 0;
+unsigned long focusStatSwitches = 0;
+unsigned long focusStatSameTitles = 0;
+double focusStatLookupTotalMS = 0;
+double focusStatLookupMaxMS = 0;
+
+
+/* for HAPTIC_SETTLE_MS, only touched by the main event loop */
+int hapticSettleTimerFD = -1;
+
+/* setup messages sent after settling, ones skipped because the mapping
+   switched again while settling, and ones skipped because it switched
+   back to the mapping the TourBox already had */
+unsigned long hapticStatSent = 0;
+unsigned long hapticStatSuperseded = 0;
+unsigned long hapticStatCancelled = 0;
+
+
+/* what waitForFocusWake saw, as bits */
+#define FOCUS_WAKE_SOURCE       1
+#define FOCUS_WAKE_RECHECK      2
+#define FOCUS_WAKE_SOURCE_LOST  4
+
+
+/* starts the focus thread, with focusSource if it can be set up,
+   otherwise with xprop polling
+   returns 1 on success, 0 on failure */
+char initFocusTracking( void );
+
+void closeFocusTracking( void );
+
+void *runFocusThread( void *inUnused );
+
+/* waits for activity on inSourceFD (or just the wake pipe, if inSourceFD
+   is -1), up to inTimeoutMS, or forever if inTimeoutMS is -1
+   returns FOCUS_WAKE_ bits for what happened, or 0 on timeout */
+int waitForFocusWake( int inSourceFD, int inTimeoutMS );
+
+/* asks the focus thread to match the last window name again, for
+   a TourBox that was just added */
+void recheckFocus( void );
+
+/* called on the focus thread with the time a window name lookup started */
+void noteFocusLookup( double inStartMS );
+
+/* call after closeFocusTracking */
+void printFocusStats( void );
+
+/* starts the HAPTIC_SETTLE_MS wait on the main event loop, for any
+   TourBox whose mapping the focus thread switched */
+void handleFocusSwitch( int inFD, unsigned int inEvents );
+
+/* sends setup messages on the main event loop, for any TourBox whose
+   mapping stayed switched for HAPTIC_SETTLE_MS */
+void handleHapticSettleTimer( int inFD, unsigned int inEvents );
+
+/* sends the setup message for inDevice's active mapping, if the TourBox
+   is connected and doesn't have it already */
+void sendSwitchedSetup( TourBoxDevice *inDevice );
+
+
+/* Match cache.
+   Remembers which mapping each TourBox got for a window, keyed by window
+   id and a hash of its title, so switching back to a window we've seen
+   before doesn't scan the mappings again.  "No mapping" is remembered
+   too.  The window's process id has to match as well, since X reuses the
+   ids of windows that are gone.
+   Direct-mapped, so two windows that land in the same entry just take
+   turns.  Only touched by the focus thread, except for clearMatchCache.
+   Must be a power of 2. */
+#define MATCH_CACHE_SIZE  64
+
+typedef struct MatchCacheEntry {
+        char used;
+
+        unsigned long windowID;
+
+        /* process that owned the window, 0 if unknown */
+        unsigned long pid;
+
+        /* 0 when no mapping matches titles, so all titles of a window
+           share an entry */
+        unsigned int titleHash;
+
+        /* how many TourBoxes there were, since later ones aren't in here */
+        int numTourBoxes;
+
+        ApplicationMapping *stableMappings[ MAX_NUM_TOURBOXES ];
+        
+        /* NULL if no mapping matched */
+        ApplicationMapping *mappings[ MAX_NUM_TOURBOXES ];
+    } MatchCacheEntry;
+
+
+MatchCacheEntry matchCache[ MATCH_CACHE_SIZE ];
+
+unsigned long matchCacheHits = 0;
+unsigned long matchCacheMisses = 0;
+
+
+/* empties the match cache
+   Call whenever appMappings change, like when the settings file is
+   loaded, while the focus thread isn't running. */
+void clearMatchCache( void );
+
+/* FNV-1a hash of a string */
+unsigned int hashString( const char *inString );
+
+
+
+void clearMatchCache( void ) {
+    memset( matchCache, 0, sizeof( matchCache ) );
+    }
+
+
+
+unsigned int hashString( const char *inString ) {
+    unsigned int hash = 2166136261U;
+
+    while( *inString != '\0' ) {
+        hash ^= (unsigned char)( *inString );
+        hash *= 16777619U;
+        inString++;
+        }
+    return hash;
+    }
+
+
+
+/* Window states.
+   Remembers what we learned about each of the last MAX_WINDOW_STATES
+   windows to come to the front:  their stable fields, which mappings those
+   matched, and the stable mapping each TourBox got.  Switching back to one
+   of these windows doesn't look up its WM_CLASS or process again, or match
+   its stable fields again, no matter how its title changed while it was in
+   the background.
+   X can reuse the id of a window that's gone, so a window only gets its
+   state back if it still belongs to the same process.  When the table is
+   full, the least recently used window is forgotten.
+   Only touched by the focus thread, except for clearWindowStates. */
+#define MAX_WINDOW_STATES  32
+
+typedef struct WindowState {
+        /* 0 for an unused entry */
+        unsigned long windowID;
+
+        /* windowStateClock when it was last used */
+        unsigned long lastUsed;
+
+        /* the stable fields of the window */
+        unsigned long pid;
+        char wmClass[ MAX_WM_CLASS_LENGTH + 1 ];
+        char processName[ MAX_PROCESS_NAME_LENGTH + 1 ];
+        char exePath[ MAX_EXE_PATH_LENGTH + 1 ];
+
+        /* how many TourBoxes there were, since later ones aren't in here */
+        int numTourBoxes;
+
+        /* what the stable fields matched */
+        unsigned int stableMatchBits[ MATCH_BITS_WORDS ];
+        ApplicationMapping *stableMappings[ MAX_NUM_TOURBOXES ];
+    } WindowState;
+
+
+WindowState windowStates[ MAX_WINDOW_STATES ];
+
+unsigned long windowStateClock = 0;
+
+unsigned long windowStateHits = 0;
+unsigned long windowStateMisses = 0;
+
+
+/* forgets every window
+   Call whenever appMappings change, like when the settings file is
+   loaded, while the focus thread isn't running. */
+void clearWindowStates( void );
+
+/* returns the state of inWindowID, marked as just used, or NULL if it
+   isn't remembered */
+WindowState *findWindowState( unsigned long inWindowID );
+
+/* remembers inWindow's stable fields and what they matched, along with
+   the stable mapping of each of the first inNumTourBoxes TourBoxes,
+   forgetting the least recently used window if the table is full */
+void rememberWindowState( const WindowInfo *inWindow, int inNumTourBoxes );
+
+
+
+void clearWindowStates( void ) {
+    memset( windowStates, 0, sizeof( windowStates ) );
+    }
+
+
+
+WindowState *findWindowState( unsigned long inWindowID ) {
+    int i;
+
+    if( inWindowID == 0 ) {
+        return NULL;
+        }
+    
+    for( i=0; i<MAX_WINDOW_STATES; i++ ) {
+        if( windowStates[i].windowID == inWindowID ) {
+            windowStateClock++;
+            windowStates[i].lastUsed = windowStateClock;
+            return &( windowStates[i] );
+            }
+        }
+    return NULL;
+    }
+
+
+
+char restoreWindowInfo( WindowInfo *ioWindow, unsigned long inPID ) {
+    WindowState *state = findWindowState( ioWindow->id );
+
+    if( state == NULL ) {
+        return 0;
+        }
+    if( state->pid != inPID ) {
+        /* a new window that got the id of one that's gone */
+        state->windowID = 0;
+        return 0;
+        }
+
+    strcpy( ioWindow->wmClass, state->wmClass );
+    strcpy( ioWindow->processName, state->processName );
+    strcpy( ioWindow->exePath, state->exePath );
+    ioWindow->pid = inPID;
+    
+    return 1;
+    }
+
+
+
+void rememberWindowState( const WindowInfo *inWindow, int inNumTourBoxes ) {
+    WindowState *state = findWindowState( inWindow->id );
+    int d;
+    
+    if( inWindow->id == 0 ) {
+        return;
+        }
+    
+    if( state == NULL ) {
+        int i;
+
+        /* unused entries have a lastUsed of 0, so they go first */
+        state = &( windowStates[0] );
+        
+        for( i=1; i<MAX_WINDOW_STATES; i++ ) {
+            if( windowStates[i].lastUsed < state->lastUsed ) {
+                state = &( windowStates[i] );
+                }
+            }
+        
+        windowStateClock++;
+        state->windowID = inWindow->id;
+        state->lastUsed = windowStateClock;
+        }
+    
+    state->pid = inWindow->pid;
+    strcpy( state->wmClass, inWindow->wmClass );
+    strcpy( state->processName, inWindow->processName );
+    strcpy( state->exePath, inWindow->exePath );
+    
+    state->numTourBoxes = inNumTourBoxes;
+    memcpy( state->stableMatchBits, stableMatchBits,
+            sizeof( state->stableMatchBits ) );
+    
+    for( d=0; d<inNumTourBoxes; d++ ) {
+        state->stableMappings[d] = tourBoxDevices[d].stableMapping;
+        }
+    }
+
+
+
+/* fetches the active window with xprop, and switches to it
+   If inRecheck is 1, everything is matched again, even if the window is
+   the same as last time.
+   Only called on the focus thread. */
+void checkActiveWindow( char inRecheck );
+
+/* if inWindow belongs to a different application than before,
+   publishes that application's mapping (or NULL if no mapping matches)
+   as the active mapping of each TourBox, and wakes the main event loop
+   to send setup messages for it
+   inNewWindow is 1 if inWindow is a different window than last time (or
+   the stable fields should be matched again anyway), or 0 if only its
+   title changed.
+   Only called on the focus thread. */
+void switchActiveWindow( const WindowInfo *inWindow, char inNewWindow );
+
+
+void checkActiveWindow( char inRecheck ) {
+    char newWindow;
+
+    if( ! getActiveWindowInfo( &activeWindowInfo, &newWindow ) ) {
+        /* no window name, nothing to switch to */
+        return;
+        }
+
+    switchActiveWindow( &activeWindowInfo, newWindow || inRecheck );
+    }
+
+
+
+void switchActiveWindow( const WindowInfo *inWindow, char inNewWindow ) {
+    int d;
+    char switched = 0;
+    unsigned char switchByte = 1;
+    unsigned int titleHash = 0;
+    MatchCacheEntry *entry;
+    char cacheHit;
+    WindowState *state = NULL;
+    char matchStable = inNewWindow;
+    int numTourBoxes = numTourBoxDevices;
+
+    if( ! inNewWindow && numTitleMappings == 0 ) {
+        /* only the title changed, and nothing cares about titles */
+        return;
+        }
+
+    if( ! inNewWindow ) {
+        if( strcmp( inWindow->title, lastMatchedTitle ) == 0 ) {
+            focusStatSameTitles++;
+            return;
+            }
+        }
+    strcpy( lastMatchedTitle, inWindow->title );
+
+    if( numTitleMappings > 0 ) {
+        titleHash = hashString( inWindow->title );
+        }
+    
+    entry = &( matchCache[ ( inWindow->id ^ titleHash ) &
+                           ( MATCH_CACHE_SIZE - 1 ) ] );
+
+    cacheHit =
+        entry->used &&
+        entry->windowID == inWindow->id &&
+        entry->pid == inWindow->pid &&
+        entry->titleHash == titleHash &&
+        entry->numTourBoxes == numTourBoxes;
+
+    if( inNewWindow ) {
+        state = findWindowState( inWindow->id );
+
+        if( state != NULL &&
+            ( state->numTourBoxes != numTourBoxes ||
+              state->pid != inWindow->pid ) ) {
+            state = NULL;
+            }
+        }
+    
+    if( cacheHit ) {
+        matchCacheHits++;
+        matchStable = 0;
+        }
+    else {
+        matchCacheMisses++;
+
+        if( inNewWindow ) {
+            if( state != NULL ) {
+                /* back to a window we know, and its stable fields can't
+                   have changed */
+                windowStateHits++;
+                memcpy( stableMatchBits, state->stableMatchBits,
+                        sizeof( stableMatchBits ) );
+                matchStable = 0;
+                }
+            else {
+                windowStateMisses++;
+                }
+            }
+        
+        /* scan each field once for every mapping */
+        findWindowMatches( inWindow, matchStable );
+        
+        entry->used = 1;
+        entry->windowID = inWindow->id;
+        entry->pid = inWindow->pid;
+        entry->titleHash = titleHash;
+        entry->numTourBoxes = numTourBoxes;
+        }
+    
+    for( d=0; d<numTourBoxes; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        ApplicationMapping *match;
+
+        if( cacheHit ) {
+            device->stableMapping = entry->stableMappings[d];
+            match = entry->mappings[d];
+            }
+        else {
+            /* the stable fields only need matching once per window, and
+               then title changes only need to look at title mappings that
+               come before the stable match */
+            if( matchStable ) {
+                device->stableMapping =
+                    getMatchingMapping( d, MATCH_STABLE_FIELDS, NULL );
+                }
+            else if( inNewWindow ) {
+                device->stableMapping = state->stableMappings[d];
+                }
+        
+            match = device->stableMapping;
+        
+            if( numTitleMappings > 0 ) {
+                match = getMatchingMapping( d, MATCH_TITLE_FIELDS,
+                                            device->stableMapping );
+                }
+
+            entry->stableMappings[d] = device->stableMapping;
+            entry->mappings[d] = match;
+            }
+        
+        if( match != device->activeMapping ) {
+            /* mappings are all filled in before any threads start, so
+               the pointer is all that needs publishing */
+            __sync_synchronize();
+            device->activeMapping = match;
+            switched = 1;
+            }
+        }
+
+    if( matchStable ) {
+        rememberWindowState( inWindow, numTourBoxes );
+        }
+
+    if( switched ) {
+        focusStatSwitches++;
+        
+        if( write( focusSwitchPipe[1], &switchByte, 1 ) != 1 ) {
+            /* pipe is full, so the main event loop is waking up anyway */
+            }
+        }
+    }
+
+
+
+#if NATIVE_X11_FOCUS
+
+/* only touched by the focus thread, once it is started */
+Display *x11Display = NULL;
+
+Window x11RootWindow;
+
+/* the active window, which we watch for name changes, or None */
+Window x11ActiveWindow = None;
+
+/* 1 if the active window has a _NET_WM_NAME, which wins over its WM_NAME,
+   so changes to its WM_NAME can be ignored */
+char x11ActiveWindowHasNetName = 0;
+
+Atom x11NetActiveWindowAtom;
+Atom x11NetWMNameAtom;
+Atom x11UTF8StringAtom;
+Atom x11NetWMPIDAtom;
+
+
+/* returns 1 on success, 0 if there's no X server to connect to */
+char initX11Focus( void );
+
+/* handles X events until the focus thread is stopped (returns 1), or
+   the X server goes away (returns 0) */
+char runX11Focus( void );
+
+/* handles every event that Xlib has read from the X server so far */
+void handleX11Events( void );
+
+/* looks up the active window, watches it for name changes, and switches
+   to it */
+void updateX11ActiveWindow( void );
+
+/* reads everything about the active window into activeWindowInfo, and
+   switches to it */
+void updateX11WindowInfo( void );
+
+/* reads just the name of the active window into activeWindowInfo, after
+   inProperty changes, and switches to it */
+void updateX11WindowName( Atom inProperty );
+
+/* reads a 32-bit property from inWindow
+   returns the value, or 0 if the window doesn't have it */
+unsigned long getX11CardinalProperty( Window inWindow, Atom inProperty );
+
+/* reads a text property from inWindow into outBuffer
+   returns 1 on success, 0 if the window doesn't have it */
+char getX11TextProperty( Window inWindow, Atom inProperty, Atom inType,
+                         char *outBuffer, int inBufferSize );
+
+/* windows can go away between an event and our request about them, so
+   we ignore errors instead of exiting, which is what Xlib does by
+   default */
+int ignoreX11Error( Display *inDisplay, XErrorEvent *inEvent );
+
+
+
+int ignoreX11Error( Display *inDisplay, XErrorEvent *inEvent ) {
+    (void)inDisplay;
+    (void)inEvent;
+    return 0;
+    }
+
+
+
+char initX11Focus( void ) {
+    x11Display = XOpenDisplay( NULL );
+
+    if( x11Display == NULL ) {
+        return 0;
+        }
+
+    XSetErrorHandler( ignoreX11Error );
+    
+    x11RootWindow = DefaultRootWindow( x11Display );
+
+    x11NetActiveWindowAtom =
+        XInternAtom( x11Display, "_NET_ACTIVE_WINDOW", False );
+    x11NetWMNameAtom = XInternAtom( x11Display, "_NET_WM_NAME", False );
+    x11UTF8StringAtom = XInternAtom( x11Display, "UTF8_STRING", False );
+    x11NetWMPIDAtom = XInternAtom( x11Display, "_NET_WM_PID", False );
+
+    XSelectInput( x11Display, x11RootWindow, PropertyChangeMask );
+    
+    return 1;
+    }
+
+
+
+char runX11Focus( void ) {
+    /* find out where we're starting */
+    updateX11ActiveWindow();
+    
+    while( focusThreadContinue ) {
+        int wake;
+        
+        handleX11Events();
+
+        wake = waitForFocusWake( ConnectionNumber( x11Display ), -1 );
+
+        if( wake & FOCUS_WAKE_SOURCE_LOST ) {
+            /* don't let Xlib find out on its own, because it exits
+               when it does */
+            printf( "Lost connection to X server, polling xprop for "
+                    "window switches instead\n" );
+            x11Display = NULL;
+            x11ActiveWindow = None;
+            return 0;
+            }
+        if( ( wake & FOCUS_WAKE_RECHECK ) && activeWindowKnown ) {
+            switchActiveWindow( &activeWindowInfo, 1 );
+            }
+        }
+
+    XCloseDisplay( x11Display );
+    x11Display = NULL;
+    return 1;
+    }
+
+
+
+void handleX11Events( void ) {
+    XEvent event;
+    
+    /* XPending reads whatever is waiting on the connection, and Xlib can
+       also have events buffered from reading replies to our requests,
+       which never show up on the fd */
+    while( XPending( x11Display ) > 0 ) {
+        XNextEvent( x11Display, &event );
+
+        if( event.type != PropertyNotify ) {
+            continue;
+            }
+
+        if( event.xproperty.window == x11RootWindow &&
+            event.xproperty.atom == x11NetActiveWindowAtom ) {
+            updateX11ActiveWindow();
+            }
+        else if( event.xproperty.window == x11ActiveWindow &&
+                 ( event.xproperty.atom == x11NetWMNameAtom ||
+                   event.xproperty.atom == XA_WM_NAME ) ) {
+            updateX11WindowName( event.xproperty.atom );
+            }
+        }
+    }
+
+
+
+void updateX11ActiveWindow( void ) {
+    Atom type;
+    int format;
+    unsigned long numItems;
+    unsigned long bytesAfter;
+    unsigned char *data = NULL;
+    Window active = None;
+    
+    if( XGetWindowProperty( x11Display, x11RootWindow,
+                            x11NetActiveWindowAtom, 0, 1, False, XA_WINDOW,
+                            &type, &format, &numItems, &bytesAfter,
+                            &data ) == Success &&
+        data != NULL ) {
+        
+        if( type == XA_WINDOW && format == 32 && numItems == 1 ) {
+            /* format 32 properties come back as longs */
+            active = (Window)( *( (unsigned long *)data ) );
+            }
+        XFree( data );
+        }
+
+    if( active == x11ActiveWindow ) {
+        return;
+        }
+    
+    if( x11ActiveWindow != None ) {
+        XSelectInput( x11Display, x11ActiveWindow, NoEventMask );
+        }
+
+    x11ActiveWindow = active;
+
+    if( x11ActiveWindow == None ) {
+        /* nothing in front, like when clicking the desktop, so stay with
+           the last application, like xprop polling does */
+        return;
+        }
+    
+    XSelectInput( x11Display, x11ActiveWindow, PropertyChangeMask );
+
+    updateX11WindowInfo();
+    }
+
+
+
+void updateX11WindowInfo( void ) {
+    double startMS = getCurrentTimeMS();
+    WindowInfo *info = &activeWindowInfo;
+    unsigned long pid;
+    
+    info->id = (unsigned long)x11ActiveWindow;
+    
+    x11ActiveWindowHasNetName =
+        getX11TextProperty( x11ActiveWindow, x11NetWMNameAtom,
+                            x11UTF8StringAtom,
+                            info->title, sizeof( info->title ) );
+    
+    if( ! x11ActiveWindowHasNetName &&
+        ! getX11TextProperty( x11ActiveWindow, XA_WM_NAME, AnyPropertyType,
+                              info->title, sizeof( info->title ) ) ) {
+        info->title[0] = '\0';
+        }
+    
+    pid = getX11CardinalProperty( x11ActiveWindow, x11NetWMPIDAtom );
+
+    if( ! restoreWindowInfo( info, pid ) ) {
+        if( ! getX11TextProperty( x11ActiveWindow, XA_WM_CLASS, XA_STRING,
+                                  info->wmClass, sizeof( info->wmClass ) ) ) {
+            info->wmClass[0] = '\0';
+            }
+        readWindowProcess( pid, info );
+        }
+    
+    noteFocusLookup( startMS );
+
+    activeWindowKnown = 1;
+    switchActiveWindow( info, 1 );
+    }
+
+
+
+void updateX11WindowName( Atom inProperty ) {
+    double startMS;
+    WindowInfo *info = &activeWindowInfo;
+    char gotName;
+
+    if( inProperty == XA_WM_NAME && x11ActiveWindowHasNetName ) {
+        /* most applications set both, and we already have the one that
+           counts, so there's nothing to look up */
+        return;
+        }
+    
+    startMS = getCurrentTimeMS();
+    
+    if( inProperty == x11NetWMNameAtom ) {
+        gotName = getX11TextProperty( x11ActiveWindow, x11NetWMNameAtom,
+                                      x11UTF8StringAtom,
+                                      info->title, sizeof( info->title ) );
+        x11ActiveWindowHasNetName = gotName;
+        }
+    else {
+        gotName = getX11TextProperty( x11ActiveWindow, XA_WM_NAME,
+                                      AnyPropertyType,
+                                      info->title, sizeof( info->title ) );
+        }
+    
+    noteFocusLookup( startMS );
+    
+    if( gotName ) {
+        switchActiveWindow( info, 0 );
+        }
+    }
+
+
+
+unsigned long getX11CardinalProperty( Window inWindow, Atom inProperty ) {
+    Atom type;
+    int format;
+    unsigned long numItems;
+    unsigned long bytesAfter;
+    unsigned char *data = NULL;
+    unsigned long value = 0;
+    
+    if( XGetWindowProperty( x11Display, inWindow, inProperty, 0, 1, False,
+                            XA_CARDINAL,
+                            &type, &format, &numItems, &bytesAfter,
+                            &data ) == Success &&
+        data != NULL ) {
+        
+        if( type == XA_CARDINAL && format == 32 && numItems == 1 ) {
+            /* format 32 properties come back as longs */
+            value = *( (unsigned long *)data );
+            }
+        XFree( data );
+        }
+    return value;
+    }
+
+
+
+char getX11TextProperty( Window inWindow, Atom inProperty, Atom inType,
+                         char *outBuffer, int inBufferSize ) {
+    Atom type;
+    int format;
+    unsigned long numItems;
+    unsigned long bytesAfter;
+    unsigned char *data = NULL;
+    char found = 0;
+
+    /* length is in 32-bit units, and a longer name gets cut off */
+    if( XGetWindowProperty( x11Display, inWindow, inProperty,
+                            0, ( inBufferSize - 1 ) / 4, False, inType,
+                            &type, &format, &numItems, &bytesAfter,
+                            &data ) == Success &&
+        data != NULL ) {
+
+        if( type != None && format == 8 ) {
+            unsigned long i;
+            
+            if( numItems > (unsigned long)( inBufferSize - 1 ) ) {
+                numItems = (unsigned long)( inBufferSize - 1 );
+                }
+            memcpy( outBuffer, data, numItems );
+            outBuffer[ numItems ] = '\0';
+
+            /* some properties, like WM_CLASS, hold several strings, each
+               ending with \0, so put spaces between them */
+            for( i=0; i + 1 < numItems; i++ ) {
+                if( outBuffer[i] == '\0' ) {
+                    outBuffer[i] = ' ';
+                    }
+                }
+            found = 1;
+            }
+        XFree( data );
+        }
+    
+    return found;
+    }
+
+#endif
+
+
+
+/* xprop polling, which works with any window manager that sets
+   _NET_ACTIVE_WINDOW, but only notices switches every FOCUS_POLL_MS */
+
+char initXpropFocus( void );
+
+char runXpropFocus( void );
+
+
+
+char initXpropFocus( void ) {
+    return 1;
+    }
+
+
+
+char runXpropFocus( void ) {
+    char recheck = 1;
+    
+    while( focusThreadContinue ) {
+        double startMS = getCurrentTimeMS();
+
+        checkActiveWindow( recheck );
+        noteFocusLookup( startMS );
+
+        /* a recheck means we look again right away */
+        recheck =
+            ( waitForFocusWake( -1, FOCUS_POLL_MS ) & FOCUS_WAKE_RECHECK ) != 0;
+        }
+    return 1;
+    }
+
+
+
+/* The FIFO focus source.
+   Some other program writes a line to the FIFO whenever a window comes to
+   the front, which is either the window's title, or its class (or Wayland
+   app_id), a tab, and its title.  Nothing is polled, so switches are
+   noticed as soon as the line is written. */
+
+/* from the FOCUS fifo line in the settings file */
+char focusFifoPath[ MAX_FOCUS_FIFO_PATH_LENGTH + 1 ] = "";
+
+int focusFifoFD = -1;
+
+/* we keep the FIFO open for writing too, so it doesn't report end of file
+   every time a writer closes it */
+int focusFifoWriteFD = -1;
+
+
+/* creates focusFifoPath if it doesn't exist, and opens it */
+char initFifoFocus( void );
+
+char runFifoFocus( void );
+
+/* reads everything waiting in the FIFO, and switches to the window on
+   each whole line
+   ioLine holds a partial line from the last read, with length ioLength */
+void readFifoFocus( char *ioLine, int inLineSize, int *ioLength );
+
+/* switches to the window described by one line from the FIFO */
+void handleFifoFocusLine( char *inLine );
+
+
+
+char initFifoFocus( void ) {
+    struct stat fifoStat;
+    
+    if( focusFifoPath[0] == '\0' ) {
+        return 0;
+        }
+    
+    if( mkfifo( focusFifoPath, 0600 ) != 0 && errno != EEXIST ) {
+        printf( "Failed to create focus FIFO %s\n", focusFifoPath );
+        return 0;
+        }
+    
+    focusFifoFD = open( focusFifoPath, O_RDONLY | O_NONBLOCK );
+
+    if( focusFifoFD == -1 ) {
+        printf( "Failed to open focus FIFO %s\n", focusFifoPath );
+        return 0;
+        }
+
+    if( fstat( focusFifoFD, &fifoStat ) != 0 ||
+        ! S_ISFIFO( fifoStat.st_mode ) ) {
+        printf( "%s is not a FIFO\n", focusFifoPath );
+        close( focusFifoFD );
+        focusFifoFD = -1;
+        return 0;
+        }
+
+    /* can't fail, since we have it open for reading */
+    focusFifoWriteFD = open( focusFifoPath, O_WRONLY | O_NONBLOCK );
+    
+    return 1;
+    }
+
+
+
+char runFifoFocus( void ) {
+    char line[ sizeof( activeWindowInfo.wmClass ) +
+               sizeof( activeWindowInfo.title ) ];
+    int lineLength = 0;
+    
+    while( focusThreadContinue ) {
+        int wake = waitForFocusWake( focusFifoFD, -1 );
+
+        if( wake & FOCUS_WAKE_SOURCE ) {
+            readFifoFocus( line, (int)sizeof( line ), &lineLength );
+            }
+        if( ( wake & FOCUS_WAKE_RECHECK ) && activeWindowKnown ) {
+            switchActiveWindow( &activeWindowInfo, 1 );
+            }
+        }
+
+    close( focusFifoFD );
+    close( focusFifoWriteFD );
+    focusFifoFD = -1;
+    focusFifoWriteFD = -1;
+    return 1;
+    }
+
+
+
+void readFifoFocus( char *ioLine, int inLineSize, int *ioLength ) {
+    char readBuffer[ 512 ];
+    ssize_t numRead;
+
+    while( ( numRead = read( focusFifoFD, readBuffer,
+                             sizeof( readBuffer ) ) ) > 0 ) {
+        ssize_t i;
+        
+        for( i=0; i<numRead; i++ ) {
+            if( readBuffer[i] == '\n' ) {
+                ioLine[ *ioLength ] = '\0';
+                handleFifoFocusLine( ioLine );
+                *ioLength = 0;
+                }
+            else if( *ioLength < inLineSize - 1 ) {
+                ioLine[ *ioLength ] = readBuffer[i];
+                ( *ioLength )++;
+                }
+            /* the rest of a line that's too long is dropped */
+            }
+        }
+    }
+
+
+
+void handleFifoFocusLine( char *inLine ) {
+    double startMS = getCurrentTimeMS();
+    WindowInfo *info = &activeWindowInfo;
+    const char *wmClass = "";
+    char *title = inLine;
+    char *tab = strchr( inLine, '\t' );
+    unsigned long id;
+    int length = (int)strlen( inLine );
+
+    if( length > 0 && inLine[ length - 1 ] == '\r' ) {
+        inLine[ length - 1 ] = '\0';
+        }
+
+    if( tab != NULL ) {
+        *tab = '\0';
+        wmClass = inLine;
+        title = &( tab[1] );
+        }
+
+    /* there are no window ids, so windows with the same class are treated
+       as one window whose title changes */
+    id = hashString( wmClass );
+    
+    strncpy( info->wmClass, wmClass, sizeof( info->wmClass ) - 1 );
+    info->wmClass[ sizeof( info->wmClass ) - 1 ] = '\0';
+    strncpy( info->title, title, sizeof( info->title ) - 1 );
+    info->title[ sizeof( info->title ) - 1 ] = '\0';
+
+    noteFocusLookup( startMS );
+
+    if( ! activeWindowKnown || id != info->id ) {
+        info->id = id;
+        info->processName[0] = '\0';
+        info->exePath[0] = '\0';
+        info->pid = 0;
+        activeWindowKnown = 1;
+        switchActiveWindow( info, 1 );
+        }
+    else {
+        switchActiveWindow( info, 0 );
+        }
+    }
+
+
+
+#if NATIVE_X11_FOCUS
+FocusSource x11FocusSource =
+    { "x11", "the X server", initX11Focus, runX11Focus };
+#endif
+
+FocusSource xpropFocusSource =
+    { "xprop", "xprop polling", initXpropFocus, runXpropFocus };
+
+FocusSource fifoFocusSource =
+    { "fifo", "the focus FIFO", initFifoFocus, runFifoFocus };
+
+
+
+char initFocusTracking( void ) {
+    if( pipe( focusThreadWakePipe ) != 0 ||
+        pipe( focusSwitchPipe ) != 0 ) {
+        printf( "Failed to create focus thread pipes\n" );
+        return 0;
+        }
+
+    fcntl( focusThreadWakePipe[0], F_SETFL, O_NONBLOCK );
+    fcntl( focusThreadWakePipe[1], F_SETFL, O_NONBLOCK );
+    fcntl( focusSwitchPipe[0], F_SETFL, O_NONBLOCK );
+    fcntl( focusSwitchPipe[1], F_SETFL, O_NONBLOCK );
+
+    if( ! watchEventLoopFD( focusSwitchPipe[0], EPOLLIN,
+                            handleFocusSwitch ) ) {
+        printf( "Failed to watch focus switches\n" );
+        return 0;
+        }
+
+    hapticSettleTimerFD = createEventLoopTimer( handleHapticSettleTimer );
+
+    if( hapticSettleTimerFD == -1 ) {
+        printf( "Failed to create haptic settle timer\n" );
+        return 0;
+        }
+    
+    if( ! focusSource->init() ) {
+        printf( "Can't get window switches from %s, polling xprop "
+                "instead\n", focusSource->description );
+        focusSource = &xpropFocusSource;
+        }
+    printf( "Getting window switches from %s\n", focusSource->description );
+
+    focusThreadContinue = 1;
+    
+    if( pthread_create( &focusThread, NULL, runFocusThread, NULL ) != 0 ) {
+        printf( "Failed to start focus thread\n" );
+        return 0;
+        }
+    focusThreadStarted = 1;
+    
+    return 1;
+    }
+
+
+
+void closeFocusTracking( void ) {
+    unsigned char wakeByte = 1;
+
+    if( focusThreadStarted ) {
+        focusThreadContinue = 0;
+        
+        if( write( focusThreadWakePipe[1], &wakeByte, 1 ) != 1 ) {
+            /* pipe is full, so it will wake up anyway */
+            }
+        pthread_join( focusThread, NULL );
+        focusThreadStarted = 0;
+        }
+
+    if( focusSwitchPipe[0] != -1 ) {
+        unwatchEventLoopFD( focusSwitchPipe[0] );
+        }
+    if( hapticSettleTimerFD != -1 ) {
+        unwatchEventLoopFD( hapticSettleTimerFD );
+        close( hapticSettleTimerFD );
+        hapticSettleTimerFD = -1;
+        }
+    close( focusThreadWakePipe[0] );
+    close( focusThreadWakePipe[1] );
+    close( focusSwitchPipe[0] );
+    close( focusSwitchPipe[1] );
+    }
+
+
+
+void *runFocusThread( void *inUnused ) {
+    (void)inUnused;
+    
+    if( ! focusSource->run() ) {
+        /* it stopped working, and said why */
+        focusSource = &xpropFocusSource;
+        runXpropFocus();
+        }
+    
+    return NULL;
+    }
+
+
+
+int waitForFocusWake( int inSourceFD, int inTimeoutMS ) {
+    struct pollfd waitFDs[2];
+    int numFDs = 1;
+    unsigned char wakeBytes[ 64 ];
+    int wake = 0;
+    
+    waitFDs[0].fd = focusThreadWakePipe[0];
+    waitFDs[0].events = POLLIN;
+    waitFDs[0].revents = 0;
+
+    if( inSourceFD != -1 ) {
+        waitFDs[1].fd = inSourceFD;
+        waitFDs[1].events = POLLIN;
+        waitFDs[1].revents = 0;
+        numFDs = 2;
+        }
+
+    if( poll( waitFDs, (nfds_t)numFDs, inTimeoutMS ) <= 0 ) {
+        /* timeout, or interrupted by a signal */
+        return 0;
+        }
+    
+    if( waitFDs[0].revents & POLLIN ) {
+        while( read( focusThreadWakePipe[0], wakeBytes, sizeof( wakeBytes ) )
+               > 0 ) {
+            }
+        wake |= FOCUS_WAKE_RECHECK;
+        }
+    if( numFDs == 2 ) {
+        if( waitFDs[1].revents & ( POLLHUP | POLLERR ) ) {
+            wake |= FOCUS_WAKE_SOURCE_LOST;
+            }
+        else if( waitFDs[1].revents & POLLIN ) {
+            wake |= FOCUS_WAKE_SOURCE;
+            }
+        }
+    return wake;
+    }
+
+
+
+void recheckFocus( void ) {
+    unsigned char wakeByte = 1;
+
+    if( ! focusThreadStarted ) {
+        /* it matches everything when it starts */
+        return;
+        }
+    if( write( focusThreadWakePipe[1], &wakeByte, 1 ) != 1 ) {
+        /* pipe is full, so a recheck is coming anyway */
+        }
+    }
+
+
+
+void noteFocusLookup( double inStartMS ) {
+    double lookupMS = getCurrentTimeMS() - inStartMS;
+
+    focusStatLookups++;
+    focusStatLookupTotalMS += lookupMS;
+    if( lookupMS > focusStatLookupMaxMS ) {
+        focusStatLookupMaxMS = lookupMS;
+        }
+    }
+
+
+
+void printFocusStats( void ) {
+    printf( "Focus stats (%s source):\n"
+            "    %lu application switches, from %lu window name lookups "
+            "averaging %.2f ms, longest %.2f ms\n"
+            "    %lu title updates skipped, with no change to the title\n"
+            "    match cache: %lu hits, %lu misses\n"
+            "    window states: %lu restored, %lu looked up\n"
+            "    haptics: %lu sent, %lu skipped for a later switch, "
+            "%lu skipped for switching back\n",
+            focusSource->name, focusStatSwitches, focusStatLookups,
+            ( focusStatLookups > 0 ) ?
+                focusStatLookupTotalMS / (double)focusStatLookups : 0,
+            focusStatLookupMaxMS,
+            focusStatSameTitles,
+            matchCacheHits, matchCacheMisses,
+            windowStateHits, windowStateMisses,
+            hapticStatSent, hapticStatSuperseded, hapticStatCancelled );
+    }
+
+
+
+void handleFocusSwitch( int inFD, unsigned int inEvents ) {
+    unsigned char switchBytes[ 64 ];
+    char restartTimer = 0;
+    int d;
+
+    (void)inEvents;
+    
+    while( read( inFD, switchBytes, sizeof( switchBytes ) ) > 0 ) {
+        }
+    
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        ApplicationMapping *mapping = device->activeMapping;
+        
+        if( mapping == device->setupMapping ) {
+            if( device->setupSettling ) {
+                device->setupSettling = 0;
+                hapticStatCancelled++;
+                }
+            continue;
+            }
+
+        if( HAPTIC_SETTLE_MS == 0 ) {
+            sendSwitchedSetup( device );
+            continue;
+            }
+
+        if( device->setupSettling ) {
+            if( mapping == device->settleMapping ) {
+                continue;
+                }
+            hapticStatSuperseded++;
+            }
+        
+        device->setupSettling = 1;
+        device->settleMapping = mapping;
+        restartTimer = 1;
+        }
+
+    /* every TourBox waits for the same focus to settle */
+    if( restartTimer ) {
+        setEventLoopTimer( hapticSettleTimerFD, HAPTIC_SETTLE_MS, 0 );
+        }
+    }
+
+
+
+void handleHapticSettleTimer( int inFD, unsigned int inEvents ) {
+    int d;
+
+    (void)inEvents;
+    
+    clearEventLoopTimer( inFD );
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        
+        if( device->setupSettling ) {
+            device->setupSettling = 0;
+            sendSwitchedSetup( device );
+            }
+        }
+    }
+
+
+
+void sendSwitchedSetup( TourBoxDevice *inDevice ) {
+    ApplicationMapping *mapping = inDevice->activeMapping;
+    
+    /* a TourBox that is disconnected gets the setup message for its
+       mapping when it comes back */
+    if( mapping == inDevice->setupMapping ||
+        ! inDevice->connected || inDevice->lost ) {
+        return;
+        }
+    
+    inDevice->setupMapping = mapping;
+    hapticStatSent++;
+    
+    if( ! sendTourBoxSetup( inDevice, mapping ) ) {
+        printf( "Failed to send setup message to TourBox %s "
+                "for application switch\n",
+                getTourBoxLabel( inDevice ) );
+        noteTourBoxLost( inDevice );
+        }
+    }
+
+
+
+/* TourBox connections.
+   Opening a TourBox and doing the handshake happens both at startup and
+   whenever it comes back after being unplugged (or after a USB reset on
+   a dock).  We learn about one going away from failed reads or hotplug
+   events, and about it coming back from hotplug events, where the
+   transport supports them, or by retrying every RECONNECT_RETRY_MS.
+
+   With no DEVICE lines in the settings file, we open every TourBox we
+   find.  With DEVICE lines, we only open the ones they select. */
+
+/* when a TourBox last arrived through hotplug, or -1 */
+double tourBoxArrivedMS = -1;
+
+
+/* finds the slot for a TourBox that isn't open yet, adding a slot if we
+   aren't limited to DEVICE lines
+   returns NULL if we don't want this TourBox */
+TourBoxDevice *findTourBoxSlot( const char *inPortPath,
+                                const char *inSerial );
+
+/* returns 1 if any TourBox we have opened before, or that a DEVICE
+   line selects, isn't open right now */
+char anyTourBoxMissing( void );
+
+/* does the handshake with a TourBox that the transport just opened,
+   sends the setup message for its active mapping, and starts its input
+   Closes it on failure.
+   returns 1 on success, 0 on failure */
+char connectTourBox( TourBoxDevice *inDevice );
+
+/* stops input and closes a TourBox */
+void disconnectTourBox( TourBoxDevice *inDevice );
+
+/* call for input, to measure how long a reconnect took */
+void noteTourBoxFirstInput( TourBoxDevice *inDevice );
+
+
+
+TourBoxDevice *findTourBoxSlot( const char *inPortPath,
+                                const char *inSerial ) {
+    int d;
+    TourBoxDevice *device;
+    
+    if( namedTourBoxes ) {
+        for( d=0; d<numTourBoxDevices; d++ ) {
+            device = &( tourBoxDevices[d] );
+
+            if( ! device->connected
+                &&
+                ( device->selectPort[0] == '\0' ||
+                  equal( device->selectPort, inPortPath ) )
+                &&
+                ( device->selectSerial[0] == '\0' ||
+                  equal( device->selectSerial, inSerial ) ) ) {
+                return device;
+                }
+            }
+        return NULL;
+        }
+
+    /* a TourBox that comes back gets the slot it had before */
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        device = &( tourBoxDevices[d] );
+        
+        if( ! device->connected &&
+            equal( device->portPath, inPortPath ) ) {
+            return device;
+            }
+        }
+    /* or one moved to a different port */
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        device = &( tourBoxDevices[d] );
+        
+        if( ! device->connected ) {
+            return device;
+            }
+        }
+
+    if( numTourBoxDevices >= MAX_NUM_TOURBOXES ) {
+        return NULL;
+        }
+    
+    device = &( tourBoxDevices[ numTourBoxDevices ] );
+    initTourBoxDevice( device, numTourBoxDevices );
+
+    /* the focus thread can see the new slot as soon as the count goes
+       up, so it must be all set up by then */
+    __sync_synchronize();
+    numTourBoxDevices++;
+
+    /* so it gets a mapping before the next window switch */
+    recheckFocus();
+    
+    return device;
+    }
+
+
+
+char anyTourBoxMissing( void ) {
+    int d;
+    
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( ! tourBoxDevices[d].connected ) {
+            return 1;
+            }
+        }
+    return 0;
+    }
+
+
+
+char connectTourBox( TourBoxDevice *inDevice ) {
+    double startMS = getCurrentTimeMS();
+    double handshakeMS;
+    
+    unsigned char initMessage[] =
+        { 0x55, 0x00, 0x07, 0x88, 0x94, 0x00, 0x1a, 0xfe };
+
+    unsigned char response[ 26 ];
+
+    
+    inDevice->connected = 1;
+    
+    /* Send the 8-byte init message */
+    if( ! transport->writeSync( inDevice, initMessage,
+                                sizeof( initMessage ) ) ) {
+        printf( "Failed to send 8-byte setup message to TourBox\n" );
+        disconnectTourBox( inDevice );
+        return 0;
+        }
+
+    /* read one response, should be 26 bytes */
+    if( transport->readSync( inDevice, response, sizeof( response ) ) 
+        != sizeof( response ) ) {
+        printf( "Failed to read expected 26-byte setup message from "
+                "TourBox\n" );
+        disconnectTourBox( inDevice );
+        return 0;
+        }
+
+    if( ! transport->startInput( inDevice ) ) {
+        disconnectTourBox( inDevice );
+        return 0;
+        }
+
+    /* put back the haptics for whatever application is in front
+       a fresh TourBox has no haptics set up yet, so this always sends */
+    inDevice->setupInFlight = 0;
+    inDevice->setupKnown = 0;
+    inDevice->setupPending = 0;
+    inDevice->setupSettling = 0;
+    
+    inDevice->setupMapping = inDevice->activeMapping;
+    
+    if( ! sendTourBoxSetup( inDevice, inDevice->setupMapping ) ) {
+        printf( "Failed to send setup message to TourBox "
+                "for active application\n" );
+        disconnectTourBox( inDevice );
+        return 0;
+        }
+
+    inDevice->lost = 0;
+
+    handshakeMS = getCurrentTimeMS() - startMS;
+    
+    handshakeStatDone++;
+    handshakeStatTotalMS += handshakeMS;
+    if( handshakeMS > handshakeStatMaxMS ) {
+        handshakeStatMaxMS = handshakeMS;
+        }
+    
+    if( ! inDevice->wasOpened ) {
+        inDevice->wasOpened = 1;
+
+        if( inDevice->name[0] != '\0' ) {
+            printf( "Opened TourBox %s on USB port %s through %s\n",
+                    inDevice->name, inDevice->portPath, transport->name );
+            }
+        else {
+            printf( "Opened TourBox on USB port %s through %s\n",
+                    inDevice->portPath, transport->name );
+            }
+        return 1;
+        }
+
+    inDevice->numReconnects++;
+    inDevice->reconnectedMS = getCurrentTimeMS();
+    inDevice->arrivedMS = tourBoxArrivedMS;
+    
+    if( inDevice->arrivedMS >= 0 ) {
+        printf( "Reconnected to TourBox %s, %.1f ms after it was "
+                "plugged back in\n",
+                getTourBoxLabel( inDevice ),
+                inDevice->reconnectedMS - inDevice->arrivedMS );
+        }
+    else {
+        printf( "Reconnected to TourBox %s\n", getTourBoxLabel( inDevice ) );
+        }
+    
+    return 1;
+    }
+
+
+
+void disconnectTourBox( TourBoxDevice *inDevice ) {
+    if( ! inDevice->connected ) {
+        return;
+        }
+    
+    transport->closeDevice( inDevice );
+    inDevice->connected = 0;
+    }
+
+
+
+void noteTourBoxLost( TourBoxDevice *inDevice ) {
+    if( inDevice->lost || ! inputLoopContinue ) {
+        return;
+        }
+    
+    inDevice->lost = 1;
+    
+    /* can't close the device from inside a transport callback, so do
+       the rest from the reconnect timer, right away */
+    setEventLoopTimer( reconnectTimerFD, 1, 0 );
+    }
+
+
+
+void noteTourBoxFirstInput( TourBoxDevice *inDevice ) {
+    if( inDevice->reconnectedMS < 0 ) {
+        return;
+        }
+
+    if( inDevice->arrivedMS >= 0 ) {
+        printf( "First input from TourBox %s %.1f ms after reconnecting "
+                "(%.1f ms after it was plugged back in)\n",
+                getTourBoxLabel( inDevice ),
+                getCurrentTimeMS() - inDevice->reconnectedMS,
+                getCurrentTimeMS() - inDevice->arrivedMS );
+        }
+    else {
+        printf( "First input from TourBox %s %.1f ms after reconnecting\n",
+                getTourBoxLabel( inDevice ),
+                getCurrentTimeMS() - inDevice->reconnectedMS );
+        }
+    
+    inDevice->reconnectedMS = -1;
+    inDevice->arrivedMS = -1;
+    }
+
+
+
+void handleReconnectTimer( int inFD, unsigned int inEvents ) {
+    int d;
+    
+    (void)inEvents;
+    
+    clearEventLoopTimer( inFD );
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        
+        if( device->lost && device->connected ) {
+            printf( "Lost TourBox %s, closing it and waiting for it "
+                    "to come back\n", getTourBoxLabel( device ) );
+            disconnectTourBox( device );
+        
+            /* we won't see releases for anything held down, so the
+               executor needs to let go of it all, after it finishes
+               with whatever input came before */
+            queueTourBoxReset( device->index );
+            }
+        }
+
+    if( ! anyTourBoxMissing() && tourBoxArrivedMS < 0 ) {
+        return;
+        }
+    
+    transport->scan();
+
+    if( anyTourBoxMissing() ) {
+        /* keep trying, in case we don't get hotplug events, or the
+           device isn't ready yet when it arrives */
+        setEventLoopTimer( reconnectTimerFD, RECONNECT_RETRY_MS, 0 );
+        }
+    else {
+        tourBoxArrivedMS = -1;
+        }
+    }
+
+
+
+/* libusb transport.
+   Talks to the vendor interface of each TourBox through libusb, with
+   libusb's file descriptors watched by the main event loop.  Hotplug
+   events, where libusb supports them, tell us right away when a TourBox
+   comes or goes. */
+
+libusb_context *usbContext = NULL;
+
+libusb_hotplug_callback_handle hotplugHandle;
+char hotplugRegistered = 0;
+
+
+char libusbInit( void );
+void libusbClose( void );
+int libusbScan( void );
+char libusbWriteSync( TourBoxDevice *inDevice,
+                      unsigned char *inData, int inLength );
+int libusbReadSync( TourBoxDevice *inDevice,
+                    unsigned char *outData, int inLength );
+char libusbSendSetup( TourBoxDevice *inDevice );
+void libusbCloseDevice( TourBoxDevice *inDevice );
+
+void setupMessageCallback( struct libusb_transfer *inTransfer );
+
+void handleUsbFD( int inFD, unsigned int inEvents );
+
+void usbPollFDAdded( int inFD, short inEvents, void *inUserData );
+void usbPollFDRemoved( int inFD, void *inUserData );
+
+/* fills outPath with the USB port path of inDevice, like 3-1.2, the same
+   format the kernel uses for names in /sys/bus/usb/devices */
+void getUsbPortPath( libusb_device *inDevice,
+                     char *outPath, unsigned int inPathLength );
+
+/* returns 1 if inDevice is already open as one of our TourBoxes */
+char isTourBoxOpen( libusb_device *inDevice );
+
+int tourBoxHotplugCallback( libusb_context *inContext,
+                            libusb_device *inDevice,
+                            libusb_hotplug_event inEvent,
+                            void *inUserData );
+
+
+char libusbInit( void ) {
+    const struct libusb_pollfd **usbPollFDs;
+    int i;
+    int usbResult;
+    
+    usbResult = libusb_init( &usbContext );
+
+    if( usbResult < 0 ) {
+        printf( "Failed to initialize libusb context\n" );
+        return 0;
+        }
+
+    /* libusb tells us which of its fds to watch, and tells us about
+       changes later */
+    usbPollFDs = libusb_get_pollfds( usbContext );
+
+    if( usbPollFDs == NULL ) {
+        printf( "Failed to get USB file descriptors\n" );
+        libusb_exit( usbContext );
+        return 0;
+        }
+    for( i=0; usbPollFDs[i] != NULL; i++ ) {
+        usbPollFDAdded( usbPollFDs[i]->fd, usbPollFDs[i]->events, NULL );
+        }
+    /* libusb_free_pollfds is missing from libusb before 1.0.20, but plain
+       free has always been fine on Linux */
+    free( (void *)usbPollFDs );
+
+    libusb_set_pollfd_notifiers( usbContext, usbPollFDAdded, usbPollFDRemoved,
+                                 NULL );
+
+    if( libusb_has_capability( LIBUSB_CAP_HAS_HOTPLUG ) &&
+        libusb_hotplug_register_callback(
+            usbContext,
+            LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+            LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS,
+            TOURBOX_VID, TOURBOX_PID, LIBUSB_HOTPLUG_MATCH_ANY,
+            tourBoxHotplugCallback, NULL, &hotplugHandle ) == 0 ) {
+        hotplugRegistered = 1;
+        }
+    else {
+        printf( "USB hotplug not supported, will poll to reconnect "
+                "if TourBox goes away\n" );
+        }
+    
+    return 1;
+    }
+
+
+
+void libusbClose( void ) {
+    if( hotplugRegistered ) {
+        libusb_hotplug_deregister_callback( usbContext, hotplugHandle );
+        hotplugRegistered = 0;
+        }
+    
+    libusb_set_pollfd_notifiers( usbContext, NULL, NULL, NULL );
+    
+    libusb_exit( usbContext );
+    usbContext = NULL;
+    }
+
+
+
+void getUsbPortPath( libusb_device *inDevice,
+                     char *outPath, unsigned int inPathLength ) {
+    uint8_t ports[ MAX_USB_PORT_DEPTH ];
+    int numPorts;
+    int i;
+    
+    /* room for a bus number and every port number, each up to 3 digits */
+    char path[ 4 * ( MAX_USB_PORT_DEPTH + 1 ) + 1 ];
+    unsigned int length;
+    
+    numPorts = libusb_get_port_numbers( inDevice, ports, MAX_USB_PORT_DEPTH );
+
+    length = (unsigned int)sprintf( path, "%d",
+                                    libusb_get_bus_number( inDevice ) );
+    
+    for( i=0; i<numPorts; i++ ) {
+        length += (unsigned int)sprintf( &( path[ length ] ),
+                                         ( i == 0 ) ? "-%d" : ".%d",
+                                         ports[i] );
+        }
+
+    if( length > inPathLength - 1 ) {
+        length = inPathLength - 1;
+        }
+    memcpy( outPath, path, length );
+    outPath[ length ] = '\0';
+    }
+
+
+
+char isTourBoxOpen( libusb_device *inDevice ) {
+    int d;
+    
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        TourBoxDevice *device = &( tourBoxDevices[d] );
+        
+        if( device->usbHandle != NULL &&
+            libusb_get_device( device->usbHandle ) == inDevice ) {
+            return 1;
+            }
+        }
+    return 0;
+    }
+
+
+
+int libusbScan( void ) {
+    libusb_device **list;
+    ssize_t numDevices;
+    ssize_t i;
+    int numConnected = 0;
+
+    numDevices = libusb_get_device_list( usbContext, &list );
+
+    if( numDevices < 0 ) {
+        printf( "Failed to list USB devices\n" );
+        return 0;
+        }
+    
+    for( i=0; i<numDevices; i++ ) {
+        struct libusb_device_descriptor desc;
+        libusb_device_handle *usb;
+        TourBoxDevice *device;
+        char portPath[ MAX_USB_PORT_PATH_LENGTH + 1 ];
+        char serial[ MAX_USB_SERIAL_LENGTH + 1 ];
+
+        if( libusb_get_device_descriptor( list[i], &desc ) != 0 ||
+            desc.idVendor != TOURBOX_VID ||
+            desc.idProduct != TOURBOX_PID ||
+            isTourBoxOpen( list[i] ) ) {
+            continue;
+            }
+
+        getUsbPortPath( list[i], portPath, sizeof( portPath ) );
+        
+        if( libusb_open( list[i], &usb ) != 0 ) {
+            printf( "Failed to open TourBox Elite USB device on port %s\n",
+                    portPath );
+            continue;
+            }
+
+        serial[0] = '\0';
+        
+        if( namedTourBoxes && desc.iSerialNumber != 0 ) {
+            int length =
+                libusb_get_string_descriptor_ascii( usb, desc.iSerialNumber,
+                                                    (unsigned char *)serial,
+                                                    MAX_USB_SERIAL_LENGTH );
+            if( length > 0 ) {
+                serial[ length ] = '\0';
+                }
+            }
+
+        device = findTourBoxSlot( portPath, serial );
+
+        if( device == NULL ) {
+            /* not one we want, or no room for it */
+            libusb_close( usb );
+            continue;
+            }
+        
+        memcpy( device->portPath, portPath, sizeof( portPath ) );
+        
+        libusb_set_auto_detach_kernel_driver( usb, 1 );
+
+        if( libusb_claim_interface( usb, IFACE ) != 0 ) {
+            printf( "Failed to claim TourBox Elite USB interface\n" );
+            libusb_close( usb );
+            continue;
+            }
+        
+        device->usbHandle = usb;
+        
+        if( connectTourBox( device ) ) {
+            numConnected++;
+            }
+        }
+
+    libusb_free_device_list( list, 1 );
+    
+    return numConnected;
+    }
+
+
+
+char libusbWriteSync( TourBoxDevice *inDevice,
+                      unsigned char *inData, int inLength ) {
+    int numTransfered = 0;
+    
+    libusb_bulk_transfer( inDevice->usbHandle, EP_OUT, inData, inLength,
+                          &numTransfered, USB_TIMEOUT );
+    
+    return ( numTransfered == inLength );
+    }
+
+
+
+int libusbReadSync( TourBoxDevice *inDevice,
+                    unsigned char *outData, int inLength ) {
+    int numTransfered = 0;
+    unsigned char inputBuffer[ 512 ];
+    
+    libusb_bulk_transfer( inDevice->usbHandle, EP_IN, inputBuffer,
+                          sizeof( inputBuffer ),
+                          &numTransfered, USB_TIMEOUT );
+
+    if( numTransfered > inLength ) {
+        /* more than expected, still report how many, so the caller
+           sees that it's wrong */
+        memcpy( outData, inputBuffer, (size_t)inLength );
+        }
+    else if( numTransfered > 0 ) {
+        memcpy( outData, inputBuffer, (size_t)numTransfered );
+        }
+    return numTransfered;
+    }
+
+
+
+/* We keep NUM_ASYNC_USB_TRANSFERS reads queued with libusb at all times,
+   for each open TourBox.
+   libusb calls asyncInputCallback from inside
+   libusb_handle_events_timeout_completed as each one completes, and
+   the callback re-queues the read before decoding its input. */
+
+
+/* allocates and submits all of inDevice's input transfers, and allocates
+   its setup message transfer
+   returns 1 on success, 0 on failure */
+char startAsyncInput( TourBoxDevice *inDevice );
+
+/* cancels and frees all of inDevice's transfers */
+void stopAsyncInput( libusb_context *inContext, TourBoxDevice *inDevice );
+
+void asyncInputCallback( struct libusb_transfer *inTransfer );
+
+/* returns 1 on success, 0 on failure */
+char submitAsyncInput( TourBoxDevice *inDevice, int inTransferIndex );
+
+
+
+char submitAsyncInput( TourBoxDevice *inDevice, int inTransferIndex ) {
+    int usbResult;
+    
+    inDevice->inputQueuedMS[ inTransferIndex ] = getCurrentTimeMS();
+    
+    usbResult =
+        libusb_submit_transfer( inDevice->inputTransfers[ inTransferIndex ] );
+
+    if( usbResult != 0 ) {
+        return 0;
+        }
+    
+    inDevice->inputInFlight[ inTransferIndex ] = 1;
+    noteInputReadQueued();
+    return 1;
+    }
+
+
+
+void asyncInputCallback( struct libusb_transfer *inTransfer ) {
+    int t;
+    int numBytes;
+    unsigned char inputBytes[ sizeof( tourBoxDevices[0].inputBuffers[0] ) ];
+    TourBoxDevice *device = (TourBoxDevice *)( inTransfer->user_data );
+    
+    for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+        if( device->inputTransfers[t] == inTransfer ) {
+            break;
+            }
+        }
+    if( t == NUM_ASYNC_USB_TRANSFERS ) {
+        /* not ours */
+        return;
+        }
+    
+    device->inputInFlight[t] = 0;
+    noteInputReadDone();
+
+    if( inTransfer->status == LIBUSB_TRANSFER_CANCELLED ) {
+        /* shutting down */
+        return;
+        }
+    
+    if( inTransfer->status != LIBUSB_TRANSFER_COMPLETED ) {
+        printf( "Error reading message from TourBox %s\n",
+                getTourBoxLabel( device ) );
+        inputStatErrors++;
+        noteTourBoxLost( device );
+        return;
+        }
+
+    numBytes = inTransfer->actual_length;
+
+    if( numBytes > 0 ) {
+        noteInputReadData( device->inputQueuedMS[t], numBytes );
+        noteTourBoxFirstInput( device );
+        
+        memcpy( inputBytes, inTransfer->buffer, (size_t)numBytes );
+        }
+    
+    /* queue this read back up before handling its input, which might
+       take a while (key sequences with SLEEP_ triggers) */
+    if( inputLoopContinue && ! device->inputStopping ) {
+        if( ! submitAsyncInput( device, t ) ) {
+            printf( "Failed to re-queue USB read from TourBox %s\n",
+                    getTourBoxLabel( device ) );
+            inputStatErrors++;
+            noteTourBoxLost( device );
+            }
+        }
+    
+    decodeTourBoxInput( device, inputBytes, numBytes );
+    }
+
+
+
+char startAsyncInput( TourBoxDevice *inDevice ) {
+    int t;
+    
+    for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+        inDevice->inputTransfers[t] = NULL;
+        inDevice->inputInFlight[t] = 0;
+        }
+
+    inDevice->inputStopping = 0;
+    inDevice->setupInFlight = 0;
+    
+    inDevice->setupTransfer = libusb_alloc_transfer( 0 );
+
+    if( inDevice->setupTransfer == NULL ) {
+        printf( "Failed to allocate USB transfer\n" );
+        return 0;
+        }
+    
+    for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+        inDevice->inputTransfers[t] = libusb_alloc_transfer( 0 );
+
+        if( inDevice->inputTransfers[t] == NULL ) {
+            printf( "Failed to allocate USB transfer\n" );
+            return 0;
+            }
+        
+        /* timeout of 0 means the read waits for input forever */
+        libusb_fill_bulk_transfer( inDevice->inputTransfers[t],
+                                   inDevice->usbHandle, EP_IN,
+                                   inDevice->inputBuffers[t],
+                                   sizeof( inDevice->inputBuffers[t] ),
+                                   asyncInputCallback, inDevice, 0 );
+        }
+
+    if( inputReadsPending == 0 ) {
+        inputGapStartMS = getCurrentTimeMS();
+        }
+    
+    for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+        if( ! submitAsyncInput( inDevice, t ) ) {
+            printf( "Failed to queue USB read from TourBox %s\n",
+                    getTourBoxLabel( inDevice ) );
+            return 0;
+            }
+        }
+    return 1;
+    }
+
+
+
+void stopAsyncInput( libusb_context *inContext, TourBoxDevice *inDevice ) {
+    int t;
+    int numTries = 0;
+    char anyInFlight = 1;
+
+    /* reads that complete from here on aren't queued back up */
+    inDevice->inputStopping = 1;
+    
+    /* let libusb deliver the cancellations before we free anything
+       give up after a few seconds if the device has gone away */
+    while( anyInFlight && numTries < 10 ) {
+        struct timeval tv;
+        tv.tv_sec = 0;
+        tv.tv_usec = USB_TIMEOUT * 1000;
+
+        /* cancel again each time around, in case a read was queued back
+           up by a callback that was already running */
+        anyInFlight = 0;
+        for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+            if( inDevice->inputInFlight[t] ) {
+                libusb_cancel_transfer( inDevice->inputTransfers[t] );
+                anyInFlight = 1;
+                }
+            }
+        if( inDevice->setupInFlight ) {
+            libusb_cancel_transfer( inDevice->setupTransfer );
+            anyInFlight = 1;
+            }
+        if( ! anyInFlight ) {
+            break;
+            }
+        
+        libusb_handle_events_timeout_completed( inContext, &tv, NULL );
+        numTries++;
+        }
+    
+    for( t=0; t<NUM_ASYNC_USB_TRANSFERS; t++ ) {
+        if( inDevice->inputTransfers[t] != NULL &&
+            ! inDevice->inputInFlight[t] ) {
+            libusb_free_transfer( inDevice->inputTransfers[t] );
+            inDevice->inputTransfers[t] = NULL;
+            }
+        }
+    if( inDevice->setupTransfer != NULL &&
+        ! inDevice->setupInFlight ) {
+        libusb_free_transfer( inDevice->setupTransfer );
+        inDevice->setupTransfer = NULL;
+        }
+    }
+
+
+
+
+char libusbSendSetup( TourBoxDevice *inDevice ) {
+    libusb_fill_bulk_transfer( inDevice->setupTransfer,
+                               inDevice->usbHandle, EP_OUT,
+                               inDevice->setupBuffer,
+                               TOURBOX_SETUP_MESSAGE_LENGTH,
+                               setupMessageCallback, inDevice,
+                               USB_TIMEOUT );
+
+    if( libusb_submit_transfer( inDevice->setupTransfer ) != 0 ) {
+        return 0;
+        }
+    
+    inDevice->setupInFlight = 1;
+    return 1;
+    }
+
+
+
+void setupMessageCallback( struct libusb_transfer *inTransfer ) {
+    TourBoxDevice *device = (TourBoxDevice *)( inTransfer->user_data );
+
+    if( inTransfer->status == LIBUSB_TRANSFER_CANCELLED ) {
+        /* shutting down */
+        device->setupInFlight = 0;
+        device->setupKnown = 0;
+        device->setupPending = 0;
+        return;
+        }
+
+    noteSetupMessageDone(
+        device,
+        inTransfer->status == LIBUSB_TRANSFER_COMPLETED &&
+        inTransfer->actual_length == TOURBOX_SETUP_MESSAGE_LENGTH );
+    }
+
+
+
+void libusbCloseDevice( TourBoxDevice *inDevice ) {
+    if( inDevice->usbHandle == NULL ) {
+        return;
+        }
+    
+    stopAsyncInput( usbContext, inDevice );
+    
+    libusb_release_interface( inDevice->usbHandle, IFACE );
+    libusb_close( inDevice->usbHandle );
+    inDevice->usbHandle = NULL;
+    }
+
+
+
+void handleUsbFD( int inFD, unsigned int inEvents ) {
+    struct timeval tv;
+    int usbResult;
+
+    (void)inFD;
+    (void)inEvents;
+    
+    /* something is ready, so don't wait for anything else */
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    /* completed reads call asyncInputCallback from in here */
+    usbResult = libusb_handle_events_timeout_completed( usbContext, &tv, NULL );
+
+    if( usbResult != 0 &&
+        usbResult != LIBUSB_ERROR_INTERRUPTED ) {
+        printf( "Error handling USB events for TourBox device\n" );
+        stopInputLoop();
+        }
+    }
+
+
+
+void usbPollFDAdded( int inFD, short inEvents, void *inUserData ) {
+    unsigned int events = 0;
+
+    (void)inUserData;
+    
+    if( inEvents & POLLIN ) {
+        events |= EPOLLIN;
+        }
+    if( inEvents & POLLOUT ) {
+        events |= EPOLLOUT;
+        }
+    if( ! watchEventLoopFD( inFD, events, handleUsbFD ) ) {
+        printf( "Failed to watch USB file descriptor\n" );
+        stopInputLoop();
+        }
+    }
+
+
+
+void usbPollFDRemoved( int inFD, void *inUserData ) {
+    (void)inUserData;
+    
+    unwatchEventLoopFD( inFD );
+    }
+
+
+
+int tourBoxHotplugCallback( libusb_context *inContext,
+                            libusb_device *inDevice,
+                            libusb_hotplug_event inEvent,
+                            void *inUserData ) {
+    int d;
+    
+    (void)inContext;
+    (void)inUserData;
+
+    if( inEvent == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ) {
+        tourBoxArrivedMS = getCurrentTimeMS();
+            
+        /* can't open the device from inside a hotplug callback,
+           so scan for it from the timer, right away */
+        setEventLoopTimer( reconnectTimerFD, 1, 0 );
+        }
+    else if( inEvent == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT ) {
+        for( d=0; d<numTourBoxDevices; d++ ) {
+            TourBoxDevice *device = &( tourBoxDevices[d] );
+            
+            if( device->usbHandle != NULL &&
+                libusb_get_device( device->usbHandle ) == inDevice ) {
+                noteTourBoxLost( device );
+                }
+            }
+        }
+
+    /* stay registered */
+    return 0;
+    }
+
+
+
+TourBoxTransport libusbTransport = {
+    "libusb",
+    libusbInit,
+    libusbClose,
+    libusbScan,
+    libusbWriteSync,
+    libusbReadSync,
+    startAsyncInput,
+    libusbSendSetup,
+    libusbCloseDevice
+    };
+
+
+
+/* ttyACM transport.
+   The kernel's cdc_acm driver makes a /dev/ttyACM device for each
+   TourBox, which we put in raw mode and talk to with plain read and
+   write calls, with no libusb in the process at all.  We find the right
+   ttyACM devices through sysfs, by VID and PID.
+   There are no hotplug events here, so a TourBox that goes away is
+   noticed when its tty hangs up, and found again by retrying.  A TourBox
+   plugged in later that was never opened isn't noticed at all. */
+
+char ttyInit( void );
+void ttyClose( void );
+int ttyScan( void );
+char ttyWriteSync( TourBoxDevice *inDevice,
+                   unsigned char *inData, int inLength );
+int ttyReadSync( TourBoxDevice *inDevice,
+                 unsigned char *outData, int inLength );
+char ttyStartInput( TourBoxDevice *inDevice );
+char ttySendSetup( TourBoxDevice *inDevice );
+void ttyCloseDevice( TourBoxDevice *inDevice );
+
+void handleTtyFD( int inFD, unsigned int inEvents );
+
+/* reads the first line of a sysfs file, without its newline
+   returns 1 on success, 0 on failure */
+char readSysfsFile( const char *inDirPath, const char *inFileName,
+                    char *outValue, int inValueLength );
+
+/* opens a tty device in raw mode, non-blocking
+   returns the fd, or -1 on failure */
+int openRawTty( const char *inPath );
+
+
+
+char ttyInit( void ) {
+    return 1;
+    }
+
+
+
+void ttyClose( void ) {
+    }
+
+
+
+char readSysfsFile( const char *inDirPath, const char *inFileName,
+                    char *outValue, int inValueLength ) {
+    char path[ 128 ];
+    FILE *file;
+    int i = 0;
+
+    sprintf( path, "%s/%s", inDirPath, inFileName );
+    
+    file = fopen( path, "r" );
+
+    if( file == NULL ) {
+        return 0;
+        }
+    if( fgets( outValue, inValueLength, file ) == NULL ) {
+        fclose( file );
+        return 0;
+        }
+    fclose( file );
+
+    while( outValue[i] != '\0' && outValue[i] != '\n' ) {
+        i++;
+        }
+    outValue[i] = '\0';
+    
+    return 1;
+    }
+
+
+
+int openRawTty( const char *inPath ) {
+    struct termios settings;
+    int fd = open( inPath, O_RDWR | O_NOCTTY | O_NONBLOCK );
+
+    if( fd == -1 ) {
+        return -1;
+        }
+
+    if( tcgetattr( fd, &settings ) != 0 ) {
+        close( fd );
+        return -1;
+        }
+
+    /* raw bytes both ways, no line editing, echo, signals,
+       or flow control */
+    settings.c_iflag &= ~(tcflag_t)( IGNBRK | BRKINT | PARMRK | ISTRIP |
+                                     INLCR | IGNCR | ICRNL |
+                                     IXON | IXOFF );
+    settings.c_oflag &= ~(tcflag_t)OPOST;
+    settings.c_lflag &= ~(tcflag_t)( ECHO | ECHONL | ICANON | ISIG | IEXTEN );
+    settings.c_cflag &= ~(tcflag_t)( CSIZE | PARENB );
+    settings.c_cflag |= (tcflag_t)( CS8 | CLOCAL | CREAD );
+    settings.c_cc[ VMIN ] = 0;
+    settings.c_cc[ VTIME ] = 0;
+
+    if( tcsetattr( fd, TCSANOW, &settings ) != 0 ) {
+        close( fd );
+        return -1;
+        }
+
+    /* throw away anything left over from before we opened it */
+    tcflush( fd, TCIOFLUSH );
+    
+    return fd;
+    }
+
+
+
+int ttyScan( void ) {
+    DIR *ttyDir;
+    struct dirent *entry;
+    int numConnected = 0;
+    int d;
+    
+    ttyDir = opendir( "/sys/class/tty" );
+
+    if( ttyDir == NULL ) {
+        printf( "Failed to list tty devices\n" );
+        return 0;
+        }
+    
+    while( ( entry = readdir( ttyDir ) ) != NULL ) {
+        /* the tty belongs to one of the TourBox's USB interfaces, and
+           the TourBox's USB device is the parent of that */
+        char usbPath[ 64 ];
+        char ttyPath[ MAX_TTY_PATH_LENGTH + 1 ];
+        char value[ 16 ];
+        char busNumber[ 16 ];
+        char devPath[ MAX_USB_PORT_PATH_LENGTH + 1 ];
+        char portPath[ MAX_USB_PORT_PATH_LENGTH + 1 ];
+        char serial[ MAX_USB_SERIAL_LENGTH + 1 ];
+        unsigned int vid = 0;
+        unsigned int pid = 0;
+        char alreadyOpen = 0;
+        TourBoxDevice *device;
+        int fd;
+        
+        if( ! startsWith( entry->d_name, "ttyACM" ) ||
+            strlen( entry->d_name ) > 16 ) {
+            continue;
+            }
+
+        sprintf( usbPath, "/sys/class/tty/%s/device/..", entry->d_name );
+        
+        if( ! readSysfsFile( usbPath, "idVendor", value, sizeof( value ) ) ||
+            sscanf( value, "%x", &vid ) != 1 ||
+            ! readSysfsFile( usbPath, "idProduct", value, sizeof( value ) ) ||
+            sscanf( value, "%x", &pid ) != 1 ||
+            vid != TOURBOX_VID ||
+            pid != TOURBOX_PID ) {
+            continue;
+            }
+
+        sprintf( ttyPath, "/dev/%s", entry->d_name );
+
+        for( d=0; d<numTourBoxDevices; d++ ) {
+            if( tourBoxDevices[d].ttyFD != -1 &&
+                equal( tourBoxDevices[d].ttyPath, ttyPath ) ) {
+                alreadyOpen = 1;
+                }
+            }
+        if( alreadyOpen ) {
+            continue;
+            }
+
+        /* same port path format that libusb gives us, like 3-1.2 */
+        portPath[0] = '\0';
+        
+        if( readSysfsFile( usbPath, "busnum",
+                           busNumber, sizeof( busNumber ) ) &&
+            readSysfsFile( usbPath, "devpath",
+                           devPath, sizeof( devPath ) ) &&
+            strlen( busNumber ) + strlen( devPath ) + 1
+            <= MAX_USB_PORT_PATH_LENGTH ) {
+            sprintf( portPath, "%s-%s", busNumber, devPath );
+            }
+        
+        if( ! readSysfsFile( usbPath, "serial", serial, sizeof( serial ) ) ) {
+            serial[0] = '\0';
+            }
+        
+        device = findTourBoxSlot( portPath, serial );
+
+        if( device == NULL ) {
+            /* not one we want, or no room for it */
+            continue;
+            }
+
+        fd = openRawTty( ttyPath );
+
+        if( fd == -1 ) {
+            printf( "Failed to open TourBox Elite tty device %s\n",
+                    ttyPath );
+            continue;
+            }
+        
+        memcpy( device->portPath, portPath, sizeof( portPath ) );
+        memcpy( device->ttyPath, ttyPath, sizeof( ttyPath ) );
+        device->ttyFD = fd;
+        
+        if( connectTourBox( device ) ) {
+            numConnected++;
+            }
+        }
+
+    closedir( ttyDir );
+    
+    return numConnected;
+    }
+
+
+
+char ttyWriteSync( TourBoxDevice *inDevice,
+                   unsigned char *inData, int inLength ) {
+    int numWritten = 0;
+    double startMS = getCurrentTimeMS();
+    
+    while( numWritten < inLength ) {
+        struct pollfd ttyPoll;
+        ssize_t result;
+        int waitMS = USB_TIMEOUT - (int)( getCurrentTimeMS() - startMS );
+
+        if( waitMS <= 0 ) {
+            return 0;
+            }
+        
+        ttyPoll.fd = inDevice->ttyFD;
+        ttyPoll.events = POLLOUT;
+        ttyPoll.revents = 0;
+        
+        if( poll( &ttyPoll, 1, waitMS ) <= 0 ) {
+            continue;
+            }
+
+        result = write( inDevice->ttyFD, &( inData[ numWritten ] ),
+                        (size_t)( inLength - numWritten ) );
+
+        if( result > 0 ) {
+            numWritten += (int)result;
+            }
+        else if( result < 0 && errno != EAGAIN && errno != EINTR ) {
+            return 0;
+            }
+        }
+    return 1;
+    }
+
+
+
+int ttyReadSync( TourBoxDevice *inDevice,
+                 unsigned char *outData, int inLength ) {
+    int numRead = 0;
+    double startMS = getCurrentTimeMS();
+    
+    while( numRead < inLength ) {
+        struct pollfd ttyPoll;
+        ssize_t result;
+        int waitMS = USB_TIMEOUT - (int)( getCurrentTimeMS() - startMS );
+
+        if( waitMS <= 0 ) {
+            break;
+            }
+        
+        ttyPoll.fd = inDevice->ttyFD;
+        ttyPoll.events = POLLIN;
+        ttyPoll.revents = 0;
+        
+        if( poll( &ttyPoll, 1, waitMS ) <= 0 ) {
+            continue;
+            }
+
+        result = read( inDevice->ttyFD, &( outData[ numRead ] ),
+                       (size_t)( inLength - numRead ) );
+
+        if( result > 0 ) {
+            numRead += (int)result;
+            }
+        else if( result == 0 ||
+                 ( errno != EAGAIN && errno != EINTR ) ) {
+            /* hung up */
+            break;
+            }
+        }
+    return numRead;
+    }
+
+
+
+char ttyStartInput( TourBoxDevice *inDevice ) {
+    if( ! watchEventLoopFD( inDevice->ttyFD, EPOLLIN, handleTtyFD ) ) {
+        printf( "Failed to watch TourBox tty device\n" );
+        return 0;
+        }
+
+    /* the kernel always has a read queued with the TourBox for us,
+       so as far as the input stats go, ours is always queued */
+    if( inputReadsPending == 0 ) {
+        inputGapStartMS = getCurrentTimeMS();
+        }
+    noteInputReadQueued();
+
+    inDevice->inputInFlight[0] = 1;
+    inDevice->inputQueuedMS[0] = getCurrentTimeMS();
+    
+    return 1;
+    }
+
+
+
+void handleTtyFD( int inFD, unsigned int inEvents ) {
+    TourBoxDevice *device = NULL;
+    unsigned char inputBytes[ 512 ];
+    ssize_t numBytes;
+    int d;
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( tourBoxDevices[d].ttyFD == inFD ) {
+            device = &( tourBoxDevices[d] );
+            }
+        }
+    if( device == NULL ) {
+        /* not ours anymore */
+        unwatchEventLoopFD( inFD );
+        return;
+        }
+    
+    while( ( numBytes = read( inFD, inputBytes, sizeof( inputBytes ) ) )
+           > 0 ) {
+        noteInputReadData( device->inputQueuedMS[0], (int)numBytes );
+        noteTourBoxFirstInput( device );
+        
+        decodeTourBoxInput( device, inputBytes, (int)numBytes );
+        }
+
+    /* anything that arrives from here on wasn't waiting for us */
+    device->inputQueuedMS[0] = getCurrentTimeMS();
+    
+    if( numBytes == 0 ||
+        ( errno != EAGAIN && errno != EINTR ) ||
+        ( inEvents & ( EPOLLHUP | EPOLLERR ) ) ) {
+        
+        printf( "Error reading message from TourBox %s\n",
+                getTourBoxLabel( device ) );
+        inputStatErrors++;
+        
+        /* stop watching now, or a hung up tty wakes us over and over
+           until the reconnect timer closes it */
+        unwatchEventLoopFD( inFD );
+        noteTourBoxLost( device );
+        }
+    }
+
+
+
+char ttySendSetup( TourBoxDevice *inDevice ) {
+    ssize_t result = write( inDevice->ttyFD, inDevice->setupBuffer,
+                            TOURBOX_SETUP_MESSAGE_LENGTH );
+
+    if( result != TOURBOX_SETUP_MESSAGE_LENGTH ) {
+        return 0;
+        }
+
+    /* the kernel has it now, and sends it on its own */
+    noteSetupMessageDone( inDevice, 1 );
+    return 1;
+    }
+
+
+
+void ttyCloseDevice( TourBoxDevice *inDevice ) {
+    if( inDevice->ttyFD == -1 ) {
+        return;
+        }
+
+    if( inDevice->inputInFlight[0] ) {
+        inDevice->inputInFlight[0] = 0;
+        noteInputReadDone();
+        }
+    
+    unwatchEventLoopFD( inDevice->ttyFD );
+    close( inDevice->ttyFD );
+    inDevice->ttyFD = -1;
+    }
+
+
+
+TourBoxTransport ttyTransport = {
+    "ttyACM",
+    ttyInit,
+    ttyClose,
+    ttyScan,
+    ttyWriteSync,
+    ttyReadSync,
+    ttyStartInput,
+    ttySendSetup,
+    ttyCloseDevice
+    };
+
+
+
+/* parses the rest of a DEVICE line from the settings file, after the
+   DEVICE keyword, adding a TourBox to tourBoxDevices
+   DEVICE name [PORT usbPortPath] [SERIAL serialNumber] */
+void parseDeviceLine( char *inLine, int inLineNumber );
+
+/* parses the rest of a PROFILE line from the settings file, after the
+   PROFILE keyword
+   returns the index of the TourBox it names, ALL_TOURBOXES if it names
+   none, or UNKNOWN_TOURBOX */
+int parseProfileLine( char *inLine, int inLineNumber );
+
+/* parses the rest of a TRANSPORT line from the settings file, after the
+   TRANSPORT keyword, and picks that transport
+   TRANSPORT libusb|ttyACM */
+void parseTransportLine( char *inLine, int inLineNumber );
+
+/* parses the rest of a FOCUS line from the settings file, after the
+   FOCUS keyword, and picks that focus source
+   FOCUS x11|xprop|fifo fifoPath */
+void parseFocusLine( char *inLine, int inLineNumber );
+
+/* parses the rest of a PACE line from the settings file, after the
+   PACE keyword, into the pacing of inMapping
+   PACE [GAP ms] [RATE turnsPerSecond] [BURST turns] */
+void parsePaceLine( char *inLine, int inLineNumber,
+                    ApplicationMapping *inMapping );
+
+/* checks for a match field keyword before a quoted application name,
+   like CLASS "gimp", setting outMatchField to its MATCH_ value
+   returns how many characters to skip to get to the quoted name, or its
+   re: or glob: prefix, or 0 if there's no keyword */
+int parseMatchField( const char *inLine, int *outMatchField );
+
+/* checks for a re: or glob: prefix before a quoted application name,
+   like glob:"*.blend - Blender*", setting outPatternKind to its PATTERN_
+   value
+   returns how many characters to skip to get to the opening quote, or 0
+   if there's no prefix */
+int parsePatternKind( const char *inLine, int *outPatternKind );
+
+
+
+void parseDeviceLine( char *inLine, int inLineNumber ) {
+    TourBoxDevice *device;
+    char *nextParsePos;
+    char token[ 80 ];
+    int d;
+
+    if( numTourBoxDevices >= MAX_NUM_TOURBOXES ) {
+        printf( "\nWARNING:\n"
+                "Reached TourBox limit of %d, skipping DEVICE line %d\n\n",
+                MAX_NUM_TOURBOXES, inLineNumber );
+        return;
+        }
+    
+    device = &( tourBoxDevices[ numTourBoxDevices ] );
+    initTourBoxDevice( device, numTourBoxDevices );
+
+    nextParsePos = getNextTokenAndAdvance( inLine, device->name,
+                                           sizeof( device->name ) );
+
+    if( device->name[0] == '\0' ) {
+        printf( "\nWARNING:\n"
+                "Skipping DEVICE line %d that has no name\n\n",
+                inLineNumber );
+        return;
+        }
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( equal( tourBoxDevices[d].name, device->name ) ) {
+            printf( "\nWARNING:\n"
+                    "Skipping DEVICE line %d for TourBox %s, which was "
+                    "already defined\n\n",
+                    inLineNumber, device->name );
+            return;
+            }
+        }
+    
+    while( 1 ) {
+        nextParsePos = getNextTokenAndAdvance( nextParsePos, token,
+                                               sizeof( token ) );
+        if( token[0] == '\0' ) {
+            break;
+            }
+        
+        if( equal( token, "PORT" ) ) {
+            nextParsePos =
+                getNextTokenAndAdvance( nextParsePos, device->selectPort,
+                                        sizeof( device->selectPort ) );
+            }
+        else if( equal( token, "SERIAL" ) ) {
+            nextParsePos =
+                getNextTokenAndAdvance( nextParsePos, device->selectSerial,
+                                        sizeof( device->selectSerial ) );
+            }
+        else {
+            printf( "\nWARNING:\n"
+                    "Skipping DEVICE line %d with unknown selector [%s]\n\n",
+                    inLineNumber, token );
+            return;
+            }
+        }
+
+    if( device->selectPort[0] == '\0' &&
+        device->selectSerial[0] == '\0' ) {
+        printf( "\nWARNING:\n"
+                "Skipping DEVICE line %d that has no PORT or SERIAL\n\n",
+                inLineNumber );
+        return;
+        }
+
+    printf( "Looking for TourBox %s\n", device->name );
+    
+    numTourBoxDevices++;
+    namedTourBoxes = 1;
+    }
+
+
+
+int parseProfileLine( char *inLine, int inLineNumber ) {
+    char name[ MAX_TOURBOX_NAME_LENGTH + 1 ];
+    int d;
+
+    getNextTokenAndAdvance( inLine, name, sizeof( name ) );
+
+    if( name[0] == '\0' ) {
+        printf( "Following mappings are for all TourBoxes\n" );
+        return ALL_TOURBOXES;
+        }
+    
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( equal( tourBoxDevices[d].name, name ) ) {
+            printf( "Following mappings are only for TourBox %s\n", name );
+            return d;
+            }
+        }
+
+    printf( "\nWARNING:\n"
+            "PROFILE line %d is for TourBox %s, which has no DEVICE line "
+            "before it.  Skipping mappings in this profile.\n\n",
+            inLineNumber, name );
+    
+    return UNKNOWN_TOURBOX;
+    }
+
+
+
+int parseMatchField( const char *inLine, int *outMatchField ) {
+    int kind;
+    int f;
+
+    for( f=0; f<NUM_MATCH_FIELDS; f++ ) {
+        int length = (int)strlen( matchFieldKeywords[f] );
+        int i = length;
+
+        if( ! startsWith( inLine, matchFieldKeywords[f] ) ||
+            ( inLine[i] != ' ' && inLine[i] != '\t' ) ) {
+            continue;
+            }
+        
+        while( inLine[i] == ' ' || inLine[i] == '\t' ) {
+            i++;
+            }
+        if( inLine[i] == '"' ||
+            parsePatternKind( &( inLine[i] ), &kind ) > 0 ) {
+            *outMatchField = f;
+            return i;
             }
         }
+    return 0;
+    }
 
-    if( pressIndex != -1 ) {
-        if( actionCode == PRESS ) {
-            if( inActiveMapping != NULL ) {
-                /* send event for this press */
-                sendUinputSequence( heldPressControlIndex, controlIndex,
-                                    inActiveMapping, inUinputFile );
-                }
-            
-            if( heldPressControlIndex == -1 ) {
-                heldPressControlIndex = pressIndex;
-                }
-            /* else something else already held, don't track new
-               hold */
-            }
-        else if( actionCode == RELEASE ) {
-            /* we never send events for releases */
 
-            /* UNLESS there's a previous combo still held down */
 
-            if( sentPressComboBufferHeld ) {
-                /* release what's held now */
-                int p;
-                
-                for( p=0; p<sentPressComboLength; p++ ) {
-                    uinputEmit( inUinputFile, EV_KEY,
-                                sentPressComboBuffer[p], 0 );
-                    }
-                /* report the end of the release combo */
-                uinputEmit( inUinputFile, EV_SYN, SYN_REPORT, 0 );
+int parsePatternKind( const char *inLine, int *outPatternKind ) {
+    int k;
 
-                sentPressComboBufferHeld = 0;
-                sentPressComboLength = 0;
-                }
-            
-            if( heldPressControlIndex == pressIndex ) {
-                /* a release of what we have marked as held */
-                heldPressControlIndex = -1;
-                }
-            }
-        }
-    else if( turnWidgetIndex != -1 ) {
-        if( inActiveMapping != NULL ) {
-            /* send event for this turn */
-            sendUinputSequence( heldPressControlIndex, controlIndex,
-                                inActiveMapping, inUinputFile );
+    for( k=PATTERN_REGEX; k<=PATTERN_GLOB; k++ ) {
+        int length = (int)strlen( patternKindPrefixes[k] );
+        
+        if( startsWith( inLine, patternKindPrefixes[k] ) &&
+            inLine[ length ] == '"' ) {
+            *outPatternKind = k;
+            return length;
             }
         }
+    return 0;
     }
 
 
 
+void parseTransportLine( char *inLine, int inLineNumber ) {
+    char name[ 16 ];
+
+    getNextTokenAndAdvance( inLine, name, sizeof( name ) );
+
+    if( equal( name, libusbTransport.name ) ) {
+        transport = &libusbTransport;
+        }
+    else if( equal( name, ttyTransport.name ) ) {
+        transport = &ttyTransport;
+        }
+    else {
+        printf( "\nWARNING:\n"
+                "Skipping TRANSPORT line %d with unknown transport [%s]\n\n",
+                inLineNumber, name );
+        return;
+        }
 
+    printf( "Using %s transport for TourBoxes\n", transport->name );
+    }
 
-char inputLoopContinue = 1;
 
 
-void SigIntHandler( int sig );
+void parseFocusLine( char *inLine, int inLineNumber ) {
+    char name[ 16 ];
+    char *nextParsePos;
 
+    nextParsePos = getNextTokenAndAdvance( inLine, name, sizeof( name ) );
 
-void SigIntHandler( int inSig ) {
-    printf( "\nGot INT signal (%d), exiting cleanly\n\n", inSig );
-    inputLoopContinue = 0;
+#if NATIVE_X11_FOCUS
+    if( equal( name, x11FocusSource.name ) ) {
+        focusSource = &x11FocusSource;
+        return;
+        }
+#endif
+    if( equal( name, xpropFocusSource.name ) ) {
+        focusSource = &xpropFocusSource;
+        return;
+        }
+    if( equal( name, fifoFocusSource.name ) ) {
+        getNextTokenAndAdvance( nextParsePos, focusFifoPath,
+                                sizeof( focusFifoPath ) );
+
+        if( focusFifoPath[0] == '\0' ) {
+            printf( "\nWARNING:\n"
+                    "Skipping FOCUS line %d with no FIFO path\n\n",
+                    inLineNumber );
+            return;
+            }
+        focusSource = &fifoFocusSource;
+        return;
+        }
+    
+    printf( "\nWARNING:\n"
+            "Skipping FOCUS line %d with unknown focus source [%s]\n\n",
+            inLineNumber, name );
     }
 
 
-/* Generates a test settings file that comprehensively tests
-   every combination of control inputs */
-void generateTestSettingsFile( const char *inOutputFileName );
 
+void parsePaceLine( char *inLine, int inLineNumber,
+                    ApplicationMapping *inMapping ) {
+    char *nextParsePos = inLine;
+    char token[ 16 ];
+    char value[ 16 ];
+    int gapMS = 0;
+    int rate = 0;
+    int burst = 1;
 
+    while( 1 ) {
+        int number;
+        
+        nextParsePos = getNextTokenAndAdvance( nextParsePos, token,
+                                               sizeof( token ) );
+        if( token[0] == '\0' ) {
+            break;
+            }
+        nextParsePos = getNextTokenAndAdvance( nextParsePos, value,
+                                               sizeof( value ) );
+        number = parseNumber( value );
+
+        if( number == -1 ) {
+            printf( "\nWARNING:\n"
+                    "Skipping PACE line %d with bad number [%s] "
+                    "for %s\n\n",
+                    inLineNumber, value, token );
+            return;
+            }
+        
+        if( equal( token, "GAP" ) ) {
+            gapMS = number;
+            }
+        else if( equal( token, "RATE" ) ) {
+            rate = number;
+            }
+        else if( equal( token, "BURST" ) ) {
+            /* at least one turn has to be able to go */
+            burst = ( number > 0 ) ? number : 1;
+            }
+        else {
+            printf( "\nWARNING:\n"
+                    "Skipping PACE line %d with unknown setting [%s]\n\n",
+                    inLineNumber, token );
+            return;
+            }
+        }
 
-/* some windows have long names, like firefox windo name for a long google
-   search string */
-char windowNameBuffer[1024];
+    inMapping->paceComboGapMS = gapMS;
+    inMapping->paceTurnRate = rate;
+    inMapping->paceTurnBurst = burst;
+    }
 
 
 
 int main( int inNumArgs, const char **inArgs ) {
-    libusb_context *usbContext = NULL;
-    libusb_device_handle *usbHandle = NULL;
-    int usbResult;
 
-    int numTransfered;
-    ApplicationMapping *activeMapping = NULL;
-    char switchResult;
-    
-    unsigned char initMessage[] =
-        { 0x55, 0x00, 0x07, 0x88, 0x94, 0x00, 0x1a, 0xfe };
+    char executorStarted = 0;
+    int d;
 
-    unsigned char inputBuffer[ 512 ];
+    /* PROFILE that new application mappings belong to */
+    int profileTourBoxIndex = ALL_TOURBOXES;
+
+    /* MATCH_ and PATTERN_ values for the next quoted application name */
+    int matchField;
+    int patternKind;
 
     const char *settingsFileName;
 
@@ -2661,7 +8847,6 @@ int main( int inNumArgs, const char **inArgs ) {
     int lineCount = 0;
 
     struct uinput_user_dev uinputUserDev;
-    int uinputFile;
     const char *uinputDevName = "TourBox Elite";
     int nameI = 0;
     int kI;
@@ -2669,11 +8854,33 @@ int main( int inNumArgs, const char **inArgs ) {
     /*
     generateTestSettingsFile( "testSettings.txt" );
     */
+
+    /*
+    benchmarkMatcher();
+    return 0;
+    */
     
     
-    signal( SIGINT, SigIntHandler );
-    
     populateSetupMap();
+    buildByteDecodings();
+
+    /*
+    benchmarkByteDecoding();
+    return 0;
+    */
+
+    /*
+    benchmarkUinputBatching();
+    return 0;
+    */
+
+    /* unless the settings file picks other ones */
+    transport = &libusbTransport;
+#if NATIVE_X11_FOCUS
+    focusSource = &x11FocusSource;
+#else
+    focusSource = &xpropFocusSource;
+#endif
     
         
     uinputFile = open( "/dev/uinput", O_WRONLY | O_NONBLOCK );
@@ -2779,6 +8986,57 @@ int main( int inNumArgs, const char **inArgs ) {
                 continue;
                 }
 
+            if( startsWith( &( fileLineBuffer[nextCharPos] ), "DEVICE " ) ||
+                startsWith( &( fileLineBuffer[nextCharPos] ), "DEVICE\t" ) ) {
+                parseDeviceLine( &( fileLineBuffer[ nextCharPos + 6 ] ),
+                                 lineCount );
+                continue;
+                }
+            
+            if( startsWith( &( fileLineBuffer[nextCharPos] ),
+                            "TRANSPORT" ) ) {
+                parseTransportLine( &( fileLineBuffer[ nextCharPos + 9 ] ),
+                                    lineCount );
+                continue;
+                }
+            
+            if( startsWith( &( fileLineBuffer[nextCharPos] ), "FOCUS" ) ) {
+                parseFocusLine( &( fileLineBuffer[ nextCharPos + 5 ] ),
+                                lineCount );
+                continue;
+                }
+            
+            if( startsWith( &( fileLineBuffer[nextCharPos] ), "PACE" ) ) {
+                if( numAppMappings == 0 ) {
+                    printf( "\nWARNING:\n"
+                            "Skipping PACE line %d that occurs before an "
+                            "application name\n\n", lineCount );
+                    }
+                else {
+                    parsePaceLine( &( fileLineBuffer[ nextCharPos + 4 ] ),
+                                   lineCount,
+                                   &( appMappings[ numAppMappings - 1 ] ) );
+                    }
+                continue;
+                }
+            
+            if( startsWith( &( fileLineBuffer[nextCharPos] ), "PROFILE" ) ) {
+                profileTourBoxIndex =
+                    parseProfileLine( &( fileLineBuffer[ nextCharPos + 7 ] ),
+                                      lineCount );
+                continue;
+                }
+            
+            matchField = MATCH_TITLE;
+            nextCharPos +=
+                parseMatchField( &( fileLineBuffer[nextCharPos] ),
+                                 &matchField );
+
+            patternKind = PATTERN_SUBSTRING;
+            nextCharPos +=
+                parsePatternKind( &( fileLineBuffer[nextCharPos] ),
+                                  &patternKind );
+            
             if( fileLineBuffer[nextCharPos] == '"' ) {
                 /* start of a new app mapping */
                 unsigned int numCharsScanned = 0;
@@ -2818,6 +9076,14 @@ int main( int inNumArgs, const char **inArgs ) {
                     }
                 m->name[ numCharsScanned ] = '\0';
 
+                m->tourBoxIndex = profileTourBoxIndex;
+                m->matchField = matchField;
+                m->patternKind = patternKind;
+
+                if( matchField == MATCH_TITLE ) {
+                    numTitleMappings++;
+                    }
+
                 if( fileLineBuffer[ nextCharPos ] != '"' ) {
                     printf( "\nWARNING:\n"
                             "Quoted application name "
@@ -2828,7 +9094,11 @@ int main( int inNumArgs, const char **inArgs ) {
                     }
                 
                 
-                printf( "Processing mappings for \"%s\"\n", m->name );
+                printf( "Processing mappings for %s %s\"%s\"\n",
+                        matchFieldKeywords[ matchField ],
+                        patternKindPrefixes[ patternKind ], m->name );
+
+                compileMappingPattern( m, lineCount );
 
                 for( h=0; h<NUM_TOURBOX_TURN_WIDGETS; h++ ) {
                     for( k=0; k<NUM_TOURBOX_PRESS_CONTROLS + 1; k++ ) {
@@ -2836,6 +9106,10 @@ int main( int inNumArgs, const char **inArgs ) {
                            rotation slow, haptics off, no-HOLD */
                         m->hapticStrength[h][k] = 0;
                         m->rotationSpeed[h][k] = 0;
+                        }
+                    }
+                for( h=0; h<NUM_TOURBOX_CONTROLS; h++ ) {
+                    for( k=0; k<NUM_TOURBOX_PRESS_CONTROLS + 1; k++ ) {
                         m->holdLastKeyCombo[h][k] = 0;
                         }
                     }
@@ -3344,164 +9618,93 @@ int main( int inNumArgs, const char **inArgs ) {
         }
     
     
+    buildAllSetupMessages();
+
+    compileAllActions();
+
+    buildMatcher();
     
+    /* nothing is cached for the mappings we just loaded */
+    clearMatchCache();
+    clearWindowStates();
     
-    usbResult = libusb_init( &usbContext );
 
-    if( usbResult < 0 ) {
-        printf( "Failed to initialize libusb context\n" );
+    if( ! initInputQueue() ) {
+        printf( "Failed to create input queue\n" );
+        close( uinputFile );
         return 1;
         }
-
-    usbHandle =
-        libusb_open_device_with_vid_pid( usbContext, TOURBOX_VID, TOURBOX_PID );
     
-    if( usbHandle == NULL ){
-        printf( "Failed to open TourBox Elite USB device\n" );
-        
-        libusb_exit( usbContext );
+    if( ! initEventLoop() ) {
+        closeEventLoop();
+        closeInputQueue();
+        close( uinputFile );
         return 1;
         }
-    
 
-    libusb_set_auto_detach_kernel_driver( usbHandle, 1 );
-
-    usbResult = libusb_claim_interface( usbHandle, IFACE );
-    
-    if( usbResult != 0 ) {
-        printf( "Failed to claim TourBox Elite USB interface\n" );
-        libusb_close( usbHandle );
-        libusb_exit( usbContext );
+    if( ! transport->init() ) {
+        closeEventLoop();
+        closeInputQueue();
+        close( uinputFile );
         return 1;
         }
     
-    /* Send the 8-byte init message */
-    usbResult = libusb_bulk_transfer( usbHandle, EP_OUT, initMessage,
-                                      sizeof( initMessage ),
-                                      &numTransfered, USB_TIMEOUT );
-
-    if( numTransfered != sizeof( initMessage ) ) {
-        printf( "Failed to send 8-byte setup message to TourBox\n" );
-        libusb_release_interface( usbHandle, IFACE );
-        libusb_close( usbHandle );
-        libusb_exit( usbContext );
+    if( transport->scan() == 0 ) {
+        printf( "Failed to open any TourBox Elite USB device\n" );
+        transport->close();
+        closeEventLoop();
+        closeInputQueue();
         close( uinputFile );
         return 1;
         }
 
-    /* read one response, should be 26 bytes */
-    usbResult = libusb_bulk_transfer( usbHandle, EP_IN, inputBuffer,
-                                      sizeof( inputBuffer ),
-                                      &numTransfered, USB_TIMEOUT );
+    printf( "Connected using %s transport\n", transport->name );
+    printMemoryFootprint();
 
-    if( numTransfered != 26 ) {
-        printf( "Failed to read expected 26-byte setup message from "
-                "TourBox\n" );
-        libusb_release_interface( usbHandle, IFACE );
-        libusb_close( usbHandle );
-        libusb_exit( usbContext );
-        close( uinputFile );
-        return 1;
+    if( anyTourBoxMissing() ) {
+        printf( "Not every TourBox from the settings file is plugged in, "
+                "will keep looking for the rest\n" );
+        setEventLoopTimer( reconnectTimerFD, RECONNECT_RETRY_MS, 0 );
         }
-
-
-    switchResult = sendDefaultSetupMessage( usbHandle );
     
-    if( ! switchResult ) {
-        printf( "Failed to send initial defaul setup message to TourBox "
-                "for application switch to no mapping\n" );
+    if( initFocusTracking() && startExecutor() ) {
+        executorStarted = 1;
+        }
+    else {
         inputLoopContinue = 0;
         }
 
+    /* read USB, watch for window switches, and wait for signals,
+       while the executor thread sends key sequences */
+    runEventLoop();
 
-    
-    while( inputLoopContinue ) {
-        char gotWindowName;
-        ApplicationMapping *match;
-        char shouldCheckWindowChange = 0;
-
-        /* read single bytes from TourBox and send uinput commands based
-           on active mapping */
-
-        usbResult = libusb_bulk_transfer( usbHandle, EP_IN, inputBuffer,
-                                          sizeof( inputBuffer ),
-                                          &numTransfered,
-                                          USB_TIMEOUT );
-        
-        if( usbResult == 0 && numTransfered == 1 ) {
-            /* trigger uniput commands based on active mapping
-               even if mapping is NULL, call this to track button
-               presses and releases */
-            handleTourBoxInput( inputBuffer[0], activeMapping, uinputFile );   
-            }
-        else if( usbResult == LIBUSB_ERROR_TIMEOUT ) {
-            shouldCheckWindowChange = 1;
-            }
-        else {
-            printf( "Error reading single byte message "
-                    "from TourBox device\n" );
-            inputLoopContinue = 0;
-            }
-        
-        
-        
-        /* only check for active window name change if we timed out
-           waiting for a control to be pressed
-           this avoids latency of running xprop when user
-           is actively pressing controls quickly.
-           Most likely, there will be a pause in TourBox input when the
-           user is switching windows, allowing our USB read to timeout */
-
-        if( shouldCheckWindowChange ) {
-            
-            gotWindowName =
-                getActiveWindowName( windowNameBuffer,
-                                     sizeof( windowNameBuffer ) );
-
-            if( gotWindowName ) {
-                match = getMatchingMapping( windowNameBuffer );
-
-                if( match == NULL ) {
-                    /* no mapping for active window */
-
-                    if( activeMapping != NULL ) {
-                        switchResult = sendDefaultSetupMessage( usbHandle );
-                        if( ! switchResult ) {
-                            printf( "Failed to send setup message to TourBox "
-                                    "for application switch to no mapping\n" );
-                            inputLoopContinue = 0;
-                            }
-                        }
-                    }
-                else {
-                    /* found a matching mapping */
-                    
-                    if( match == activeMapping ) {
-                        /* already active */
-                        }
-                    else {
-                        switchResult = makeMappingActive( match, usbHandle );
-
-                        if( ! switchResult ) {
-                            printf( "Failed to send setup message to TourBox "
-                                    "for application switch\n" );
-                            inputLoopContinue = 0;
-                            }
-                        }
-                    }
-                activeMapping = match;
-                }
-            }
+    if( executorStarted ) {
+        stopExecutor();
         }
 
+    closeFocusTracking();
     
-    printf( "\n\nShutting down USB handle and cleaning up.\n" );
+    printInputStats();
+    printFocusStats();
+
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        if( tourBoxDevices[d].numReconnects > 0 ) {
+            printf( "Reconnected to TourBox %s %lu times\n",
+                    getTourBoxLabel( &( tourBoxDevices[d] ) ),
+                    tourBoxDevices[d].numReconnects );
+            }
+        }
     
-    libusb_release_interface( usbHandle, IFACE);
+    printf( "\n\nShutting down USB handles and cleaning up.\n" );
 
-    libusb_close( usbHandle );
+    for( d=0; d<numTourBoxDevices; d++ ) {
+        disconnectTourBox( &( tourBoxDevices[d] ) );
+        }
 
-    libusb_exit( usbContext );
+    transport->close();
+    
+    closeEventLoop();
+    closeInputQueue();
 
     
     printf( "\n\nClosing /dev/uinput.\n" );
@@ -3570,3 +9773,255 @@ void generateTestSettingsFile( const char *inOutputFileName ) {
     
     fclose( f );
     }
+
+
+
+/* for the benchmarks, a fixed sequence so runs can be compared */
+unsigned long benchmarkRandomState = 1;
+
+int benchmarkRandom( int inRange );
+
+
+int benchmarkRandom( int inRange ) {
+    benchmarkRandomState = benchmarkRandomState * 1103515245UL + 12345UL;
+    return (int)( ( benchmarkRandomState >> 16 ) % (unsigned long)inRange );
+    }
+
+
+
+void benchmarkMatcher( void ) {
+    int numNamesToTry[] = { 64, 256, 1024, 4096, 10000 };
+    int numTries = sizeof( numNamesToTry ) / sizeof( numNamesToTry[0] );
+    /* more lookups for fewer names, so each run takes a similar time */
+    int numLookupsPerName = 20000;
+    WindowInfo window;
+    int t, i, k;
+
+    memset( &window, 0, sizeof( window ) );
+    
+    printf( "Matching %d-character titles against application names:\n",
+            100 );
+
+    for( t=0; t<numTries; t++ ) {
+        int numNames = numNamesToTry[t];
+        int numLookups;
+        int numFound[2] = { 0, 0 };
+        double lookupMS[2];
+        int way;
+
+        if( numNames > MAX_NUM_APPS ) {
+            printf( "    %5d names:  skipped, more than MAX_NUM_APPS (%d)\n",
+                    numNames, MAX_NUM_APPS );
+            continue;
+            }
+        numLookups = numLookupsPerName * 64 / numNames;
+        if( numLookups < 100 ) {
+            numLookups = 100;
+            }
+        
+        /* names like the words in window titles, lower case letters,
+           from 6 to 16 characters */
+        benchmarkRandomState = 1;
+        numAppMappings = numNames;
+        numTitleMappings = numNames;
+        
+        for( i=0; i<numNames; i++ ) {
+            ApplicationMapping *m = &( appMappings[i] );
+            int length = 6 + benchmarkRandom( 11 );
+            
+            for( k=0; k<length; k++ ) {
+                m->name[k] = (char)( 'a' + benchmarkRandom( 26 ) );
+                }
+            m->name[ length ] = '\0';
+            m->matchField = MATCH_TITLE;
+            m->patternKind = PATTERN_SUBSTRING;
+            m->specificity = length;
+            m->tourBoxIndex = ALL_TOURBOXES;
+            }
+
+        if( ! buildMatcher() ) {
+            printf( "    %5d names:  matcher table too small\n", numNames );
+            continue;
+            }
+        
+        /* way 0 is the matcher, way 1 is one name at a time, both with the
+           same titles */
+        for( way=0; way<2; way++ ) {
+            double startMS;
+            
+            matcherBuilt = (char)( way == 0 );
+            benchmarkRandomState = 2;
+            startMS = getCurrentTimeMS();
+            
+            for( i=0; i<numLookups; i++ ) {
+                /* random title, which has one of the names in it half of
+                   the time */
+                for( k=0; k<100; k++ ) {
+                    window.title[k] = (char)( 'a' + benchmarkRandom( 26 ) );
+                    }
+                window.title[100] = '\0';
+
+                if( benchmarkRandom( 2 ) ) {
+                    const char *name =
+                        appMappings[ benchmarkRandom( numNames ) ].name;
+                    memcpy( &( window.title[ 40 ] ), name, strlen( name ) );
+                    }
+
+                findWindowMatches( &window, 0 );
+
+                if( getMatchingMapping( 0, MATCH_TITLE_FIELDS, NULL )
+                    != NULL ) {
+                    numFound[ way ]++;
+                    }
+                }
+            lookupMS[ way ] = ( getCurrentTimeMS() - startMS ) / numLookups;
+            }
+        matcherBuilt = 1;
+        
+        printf( "    %5d names:  matcher %8.4f ms, one at a time %8.4f ms "
+                "per title (%u states, %d classes, %d/%d matched)\n",
+                numNames, lookupMS[0], lookupMS[1],
+                matcherNumStates, matcherNumClasses,
+                numFound[0], numFound[1] );
+        }
+    }
+
+
+
+void benchmarkByteDecoding( void ) {
+    /* a burst of one byte over and over is a fast knob spin, and a mix
+       of presses and releases is button use */
+    const char *streamNames[3] = { "knob spin", "buttons", "everything" };
+    unsigned char pressBytes[ 2 * NUM_TOURBOX_PRESS_CONTROLS ];
+    /* small enough to live on the stack, and repeated more to make up
+       for it */
+    unsigned char stream[ 65536 ];
+    int numStreamBytes = (int)sizeof( stream );
+    int numRepeats = 300;
+    int s, i, b;
+
+    for( i=0; i<NUM_TOURBOX_PRESS_CONTROLS; i++ ) {
+        pressBytes[ 2 * i ] = tourBoxPressControlCodes[i] | PRESS;
+        pressBytes[ 2 * i + 1 ] = tourBoxPressControlCodes[i] | RELEASE;
+        }
+
+    printf( "Decoding %d input bytes, %d times:\n",
+            numStreamBytes, numRepeats );
+    
+    for( s=0; s<3; s++ ) {
+        double decodeMS[2];
+        long checksums[2] = { 0, 0 };
+        int way;
+
+        benchmarkRandomState = 1;
+        
+        for( i=0; i<numStreamBytes; i++ ) {
+            switch( s ) {
+                case 0:
+                    stream[i] = benchmarkRandom( 8 ) == 0 ?
+                        KNOB_TURN_CCW : KNOB_TURN_CW;
+                    break;
+                case 1:
+                    stream[i] = pressBytes[
+                        benchmarkRandom( 2 * NUM_TOURBOX_PRESS_CONTROLS ) ];
+                    break;
+                default:
+                    stream[i] = (unsigned char)benchmarkRandom( 256 );
+                    break;
+                }
+            }
+
+        /* way 0 is the table, way 1 is searching */
+        for( way=0; way<2; way++ ) {
+            double startMS = getCurrentTimeMS();
+            
+            for( b=0; b<numRepeats; b++ ) {
+                for( i=0; i<numStreamBytes; i++ ) {
+                    ByteDecoding decoding;
+
+                    if( way == 0 ) {
+                        decoding = byteDecodings[ stream[i] ];
+                        }
+                    else {
+                        decodeByteBySearching( stream[i], &decoding );
+                        }
+                    checksums[ way ] += decoding.controlIndex +
+                        decoding.pressIndex + decoding.turnWidgetIndex +
+                        decoding.actionCode;
+                    }
+                }
+            decodeMS[ way ] = getCurrentTimeMS() - startMS;
+            }
+        
+        printf( "    %-10s  table %7.2f ns, searching %7.2f ns per byte%s\n",
+                streamNames[s],
+                decodeMS[0] * 1000000.0 / numStreamBytes / numRepeats,
+                decodeMS[1] * 1000000.0 / numStreamBytes / numRepeats,
+                ( checksums[0] == checksums[1] ) ? "" : "  (MISMATCH)" );
+        }
+    }
+
+
+
+void benchmarkUinputBatching( void ) {
+    /* like "www.google.com" in the settings file */
+    const char *typedString = "www.google.com";
+    int numChars = (int)strlen( typedString );
+    int numSends = 20000;
+    unsigned short steps[ MAX_KEY_SEQUENCE_STEPS ];
+    int numSteps = 0;
+    const CompiledAction *action;
+    TourBoxDevice device;
+    int nullFile;
+    int way, i;
+    
+    nullFile = open( "/dev/null", O_WRONLY );
+    if( nullFile == -1 ) {
+        printf( "Failed to open /dev/null\n" );
+        return;
+        }
+    
+    /* the same steps the settings file parser makes for a quoted string */
+    for( i=0; i<numChars; i++ ) {
+        KeyCodePair pair = getKeyCodePair( typedString[i] );
+
+        if( i > 0 ) {
+            steps[ numSteps++ ] = KEY_RESERVED;
+            }
+        steps[ numSteps++ ] = (unsigned short)( pair.first );
+        if( pair.second != -1 ) {
+            steps[ numSteps++ ] = (unsigned short)( pair.second );
+            }
+        }
+    
+    /* replaces the compiled settings file */
+    clearCompiledActions();
+    action = findOrAddCompiledAction( steps, numSteps, NULL, 0 );
+    
+    memset( &device, 0, sizeof( device ) );
+    
+    printf( "Typing \"%s\" %d times to /dev/null:\n", typedString, numSends );
+
+    /* way 0 writes each event separately, way 1 is batched */
+    for( way=0; way<2; way++ ) {
+        double startMS;
+        double typeMS;
+        
+        uinputBatchLimit = ( way == 0 ) ? 1 : UINPUT_BATCH_SIZE;
+        uinputWriteCount = 0;
+        
+        startMS = getCurrentTimeMS();
+        for( i=0; i<numSends; i++ ) {
+            sendUinputSequence( &device, action, 0, nullFile );
+            }
+        typeMS = getCurrentTimeMS() - startMS;
+
+        printf( "    %-9s  %6.2f writes, %7.1f ns per character\n",
+                ( way == 0 ) ? "separate" : "batched",
+                (double)uinputWriteCount / numSends / numChars,
+                typeMS * 1000000.0 / numSends / numChars );
+        }
+    
+    uinputBatchLimit = UINPUT_BATCH_SIZE;
+    close( nullFile );
+    }